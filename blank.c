@@ -27,89 +27,51 @@
 #include "libravatar.h"
 #include "lgpng.h"
 
-#define PNGBLANK_MAX_SIZE 255
-
-static size_t
-write_tRNS(uint8_t *buf)
+static int
+write_tRNS(struct pngw *w)
 {
-	uint32_t	crc, length;
-	size_t		bufw;
-	uint8_t		type[4] = "tRNS";
 	uint8_t		trns[2];
 
 	(void)memset(trns, 0, sizeof(trns));
-	length = htonl(sizeof(trns));
-	crc = crc32(0, Z_NULL, 0);
-	crc = crc32(crc, type, sizeof(type));
-	crc = crc32(crc, (Bytef *)trns, sizeof(trns));
-	crc = htonl(crc);
-	bufw = 0;
-	(void)memcpy(buf + bufw, &length, sizeof(length));
-	bufw += sizeof(length);
-	(void)memcpy(buf + bufw, type, sizeof(type));
-	bufw += sizeof(type);
-	(void)memcpy(buf + bufw, &trns, sizeof(trns));
-	bufw += sizeof(trns);
-	(void)memcpy(buf + bufw, &crc, sizeof(crc));
-	bufw += sizeof(crc);
-	return(bufw);
+	return(pngw_chunk(w, "tRNS", trns, sizeof(trns)));
 }
 
-static size_t
-write_IDAT(uint8_t *buf, size_t width)
+static int
+write_IDAT(struct pngw *w, size_t width)
 {
-	size_t		 dataz, deflatez;
-	uint32_t	 crc, length;
-	size_t		 bufw;
-	uint8_t		 type[4] = "IDAT";
-	uint8_t		*data, *deflate;
-
-	/* TODO: Directly write a compressed stream to avoid allocations */
+	size_t		 scanline;
+	uint8_t		*data;
+	int		 rc;
 
-	dataz = (width / (8 / 1) + \
-	    (width % (8 / 1) != 0 ? 1 : 0) + 1) * width;
-
-	if (NULL == (data = calloc(dataz, 1))) {
+	/* a single blank scanline, filter byte included, repeated */
+	scanline = width / 8 + (width % 8 != 0 ? 1 : 0) + 1;
+	if (NULL == (data = calloc(scanline, 1))) {
 		return(-1);
 	}
-	deflatez = compressBound(dataz);
-	if (NULL == (deflate = calloc(deflatez, 1))) {
-		free(data);
-		return(-1);
+	rc = pngw_IDAT_start(w, Z_DEFAULT_COMPRESSION, 15,
+	    Z_DEFAULT_STRATEGY);
+	for (size_t y = 0; 0 == rc && y < width; y++) {
+		rc = pngw_IDAT_write(w, data, scanline);
 	}
-	if (Z_OK != compress(deflate, &deflatez, data, dataz)) {
+	free(data);
+	if (0 != rc) {
 		return(-1);
 	}
-	free(data);
-	length = htonl(deflatez);
-	crc = crc32(0, Z_NULL, 0);
-	crc = crc32(crc, type, sizeof(type));
-	crc = crc32(crc, deflate, deflatez);
-	crc = htonl(crc);
-	bufw = 0;
-	(void)memcpy(buf + bufw, &length, sizeof(length));
-	bufw += sizeof(length);
-	(void)memcpy(buf + bufw, type, sizeof(type));
-	bufw += sizeof(type);
-	(void)memcpy(buf + bufw, deflate, deflatez);
-	bufw += deflatez;
-	(void)memcpy(buf + bufw, &crc, sizeof(crc));
-	bufw += sizeof(crc);
-	free(deflate);
-	return(bufw);
+	return(pngw_IDAT_end(w));
 }
 
 int
 blank(size_t width, uint8_t **buf, size_t *bufz)
 {
-	if (NULL == ((*buf) = calloc(PNGBLANK_MAX_SIZE, 1)))
+	struct pngw	*w;
+	int		 rc;
+
+	if (NULL == (w = pngw_new()))
 		return(-1);
-	*bufz = 0;
-	*bufz += write_png_sig(*buf);
-	*bufz += write_IHDR(*buf + *bufz, width, 1, COLOUR_TYPE_GREYSCALE);
-	*bufz += write_tRNS(*buf + *bufz);
-	*bufz += write_IDAT(*buf + *bufz, width);
-	*bufz += write_IEND(*buf + *bufz);
-	return(0);
+	rc = -1;
+	if (0 == pngw_IHDR(w, width, width, 1, COLOUR_TYPE_GREYSCALE) &&
+	    0 == write_tRNS(w) && 0 == write_IDAT(w, width))
+		rc = pngw_finish(w, buf, bufz);
+	pngw_free(w);
+	return(rc);
 }
-
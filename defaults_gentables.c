@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2018 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Build-time generator of the blank and mm images for every size allowed
+ * by sanitize().  Its output is written to defaults_tables.h, so that
+ * serving them is a table lookup with the length and ETag known up front.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+#include "libravatar.h"
+
+static int
+print_images(const char *name, int (*gen)(size_t, uint8_t **, size_t *))
+{
+	uint8_t		*buf;
+	size_t		 bufz, i, s;
+	uint32_t	 crc[AVATAR_MAX_SIZE];
+
+	for (s = 1; s <= AVATAR_MAX_SIZE; s++) {
+		if (0 != gen(s, &buf, &bufz))
+			return(-1);
+		crc[s - 1] = crc32(crc32(0, Z_NULL, 0), buf, bufz);
+		printf("static const unsigned char %s_%zu[%zu] = {\n",
+		    name, s, bufz);
+		for (i = 0; i < bufz; i++)
+			printf("%s%d,%s", i % 16 ? " " : "\t", buf[i],
+			    i % 16 == 15 || i == bufz - 1 ? "\n" : "");
+		printf("};\n\n");
+		free(buf);
+	}
+	/* strong ETags, quotes included */
+	printf("static const struct embedded %s_pngs[%d] = {\n", name,
+	    AVATAR_MAX_SIZE);
+	for (s = 1; s <= AVATAR_MAX_SIZE; s++)
+		printf("\t{ %s_%zu, sizeof(%s_%zu), \"\\\"%s-%zu-%08x\\\"\" },"
+		    "\n", name, s, name, s, name, s, crc[s - 1]);
+	printf("};\n\n");
+	return(0);
+}
+
+int
+main(void)
+{
+	printf("/* Generated by defaults_gentables, do not edit. */\n\n");
+	if (0 != print_images("blank", blank))
+		return(EXIT_FAILURE);
+	if (0 != print_images("mm", mm))
+		return(EXIT_FAILURE);
+	return(EXIT_SUCCESS);
+}
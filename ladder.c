@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2018 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <arpa/inet.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "libravatar.h"
+
+/*
+ * A ladder file starts with a header naming the source it was built
+ * from, then has one entry per size and the PNG images one after the
+ * other.  Integers are in network byte order.
+ */
+#define LADDER_MAGIC "LADDER01"
+
+/*
+ * Sizes scaled together out of one decode of the source.  More of them
+ * share the decode further but no longer fit in the cache.
+ */
+#define LADDER_BATCH 16
+
+struct ladder_header {
+	char		magic[8];
+	uint32_t	srcsize[2]; /* high, low */
+	uint32_t	srcmtime[2]; /* high, low */
+	uint32_t	count;
+	uint32_t	reserved;
+};
+
+struct ladder_entry {
+	uint32_t	offset;
+	uint32_t	length;
+	uint32_t	crc; /* CRC-32 of the image, for its ETag */
+};
+
+static void
+put64(uint32_t *dst, uint64_t v)
+{
+	dst[0] = htonl(v >> 32);
+	dst[1] = htonl(v & 0xffffffff);
+}
+
+static uint64_t
+get64(const uint32_t *src)
+{
+	return((uint64_t)ntohl(src[0]) << 32 | ntohl(src[1]));
+}
+
+static int
+write_all(int fd, const void *buf, size_t bufz)
+{
+	const uint8_t	*p;
+	ssize_t		 w;
+
+	for (p = buf; bufz > 0; p += w, bufz -= w)
+		if ((w = write(fd, p, bufz)) <= 0)
+			return(-1);
+	return(0);
+}
+
+/*
+ * Scale src to every size through pngscale_multi() and write the results
+ * to dst, by way of a temporary file renamed over it so that readers
+ * never see it half written.  The rungs stand in for the live render of
+ * the default image and use its settings, so that a request gets the
+ * same image whether the ladder is there or not.
+ */
+int
+ladder_build(const char *src, const char *dst)
+{
+	struct ladder_header	 hdr;
+	struct ladder_entry	*entries;
+	struct stat		 st;
+	FILE			*s;
+	unsigned char		*data[LADDER_BATCH];
+	uint32_t		 sizes[LADDER_BATCH];
+	char			 tmp[PATH_MAX];
+	size_t			 dataz[LADDER_BATCH], size, i, n;
+	uint64_t		 offset;
+	int			 fd, rc;
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", dst) >=
+	    sizeof(tmp))
+		return(-1);
+	if (NULL == (s = fopen(src, "r")))
+		return(-1);
+	if (-1 == fstat(fileno(s), &st) ||
+	    NULL == (entries = calloc(AVATAR_MAX_SIZE, sizeof(*entries)))) {
+		fclose(s);
+		return(-1);
+	}
+	(void)unlink(tmp);
+	if (-1 == (fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0444))) {
+		free(entries);
+		fclose(s);
+		return(-1);
+	}
+	rc = -1;
+	(void)memset(&hdr, 0, sizeof(hdr));
+	(void)memcpy(hdr.magic, LADDER_MAGIC, sizeof(hdr.magic));
+	put64(hdr.srcsize, st.st_size);
+	put64(hdr.srcmtime, st.st_mtime);
+	hdr.count = htonl(AVATAR_MAX_SIZE);
+	offset = sizeof(hdr) + AVATAR_MAX_SIZE * sizeof(*entries);
+	if (-1 == lseek(fd, offset, SEEK_SET))
+		goto out;
+	for (size = 1; size <= AVATAR_MAX_SIZE; size += n) {
+		n = AVATAR_MAX_SIZE + 1 - size;
+		if (n > LADDER_BATCH)
+			n = LADDER_BATCH;
+		for (i = 0; i < n; i++)
+			sizes[i] = size + i;
+		if (0 != fseeko(s, 0, SEEK_SET) ||
+		    0 != pngscale_multi(s, sizes, n, data, dataz,
+		    PNGSCALE_ONLINE))
+			goto out;
+		for (i = 0; i < n; i++) {
+			entries[size + i - 1].offset = htonl(offset);
+			entries[size + i - 1].length = htonl(dataz[i]);
+			entries[size + i - 1].crc = htonl(crc32(crc32(0,
+			    Z_NULL, 0), data[i], dataz[i]));
+			offset += dataz[i];
+			if (offset > UINT32_MAX ||
+			    0 != write_all(fd, data[i], dataz[i]))
+				break;
+			free(data[i]);
+		}
+		if (i < n) {
+			for (; i < n; i++)
+				free(data[i]);
+			goto out;
+		}
+	}
+	if (-1 == lseek(fd, 0, SEEK_SET) ||
+	    0 != write_all(fd, &hdr, sizeof(hdr)) ||
+	    0 != write_all(fd, entries, AVATAR_MAX_SIZE * sizeof(*entries)))
+		goto out;
+	if (0 != close(fd)) {
+		fd = -1;
+		goto out;
+	}
+	fd = -1;
+	if (0 == rename(tmp, dst))
+		rc = 0;
+out:
+	if (-1 != fd)
+		close(fd);
+	if (0 != rc)
+		unlink(tmp);
+	free(entries);
+	fclose(s);
+	return(rc);
+}
+
+/*
+ * Map the ladder file path if it was built from src as it is now.
+ */
+int
+ladder_open(struct ladder *l, const char *src, const char *path)
+{
+	const struct ladder_header	*hdr;
+	struct stat			 sst, st;
+	void				*map;
+	int				 fd;
+
+	l->map = NULL;
+	l->mapz = 0;
+	if (-1 == stat(src, &sst))
+		return(-1);
+	if (-1 == (fd = open(path, O_RDONLY)))
+		return(-1);
+	if (-1 == fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return(-1);
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == map)
+		return(-1);
+	l->map = map;
+	l->mapz = st.st_size;
+	hdr = map;
+	if (0 != memcmp(hdr->magic, LADDER_MAGIC, sizeof(hdr->magic)) ||
+	    get64(hdr->srcsize) != (uint64_t)sst.st_size ||
+	    get64(hdr->srcmtime) != (uint64_t)sst.st_mtime ||
+	    AVATAR_MAX_SIZE != ntohl(hdr->count) ||
+	    l->mapz < sizeof(*hdr) +
+	    AVATAR_MAX_SIZE * sizeof(struct ladder_entry)) {
+		ladder_close(l);
+		return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Point png at the image of the given size, with its ETag written to
+ * etag.
+ */
+int
+ladder_get(const struct ladder *l, size_t size, struct embedded *png,
+    char *etag, size_t etagz)
+{
+	const struct ladder_entry	*e;
+	uint32_t			 offset, length;
+
+	if (0 == size || size > AVATAR_MAX_SIZE)
+		return(-1);
+	e = (const struct ladder_entry *)(l->map +
+	    sizeof(struct ladder_header)) + size - 1;
+	offset = ntohl(e->offset);
+	length = ntohl(e->length);
+	if (offset > l->mapz || length > l->mapz - offset)
+		return(-1);
+	png->data = l->map + offset;
+	png->dataz = length;
+	(void)snprintf(etag, etagz, "\"default-%zu-%08x\"", size,
+	    ntohl(e->crc));
+	png->etag = etag;
+	return(0);
+}
+
+void
+ladder_close(struct ladder *l)
+{
+	if (NULL != l->map)
+		munmap((void *)l->map, l->mapz);
+	l->map = NULL;
+	l->mapz = 0;
+}
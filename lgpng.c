@@ -16,10 +16,16 @@
 
 #include <arpa/inet.h>
 
+#include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <zlib.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "lgpng.h"
 
 size_t
@@ -32,7 +38,8 @@ write_png_sig(uint8_t *buf)
 }
 
 size_t
-write_IHDR(uint8_t *buf, size_t width, int bitdepth, enum colourtype colour)
+write_IHDR(uint8_t *buf, size_t width, size_t height, int bitdepth,
+    enum colourtype colour)
 {
 	uint32_t	crc, length;
 	size_t		bufw;
@@ -40,7 +47,7 @@ write_IHDR(uint8_t *buf, size_t width, int bitdepth, enum colourtype colour)
 	struct IHDR	ihdr;
 
 	ihdr.width = htonl(width);
-	ihdr.height = htonl(width);
+	ihdr.height = htonl(height);
 	ihdr.bitdepth = bitdepth;
 	ihdr.colourtype = colour;
 	ihdr.compression = 0;
@@ -83,3 +90,883 @@ write_IEND(uint8_t *buf)
 	return(bufw);
 }
 
+static uint8_t
+paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+	int	p, pa, pb, pc;
+
+	p = a + b - c;
+	pa = abs(p - a);
+	pb = abs(p - b);
+	pc = abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return(a);
+	if (pb <= pc)
+		return(b);
+	return(c);
+}
+
+#if defined(__SSE2__)
+/*
+ * Sixteen bytes at a time of what filter_type() does, from i up to the
+ * last full vector.  Returns where the scalar code takes over.
+ */
+static size_t
+filter_type_sse2(uint8_t *out, int type, const uint8_t *row,
+    const uint8_t *prev, size_t i, size_t len, size_t bpp)
+{
+	__m128i	x, a, b, c, avg, zero, one;
+	__m128i	lo[3], hi[3], pa[2], pb[2], pc[2], pr[2], p, na, nb;
+	int	h;
+
+	zero = _mm_setzero_si128();
+	one = _mm_set1_epi8(1);
+	for (; i + 16 <= len; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)(row + i));
+		a = _mm_loadu_si128((const __m128i *)(row + i - bpp));
+		b = _mm_loadu_si128((const __m128i *)(prev + i));
+		switch (type) {
+		case 1:
+			x = _mm_sub_epi8(x, a);
+			break;
+		case 2:
+			x = _mm_sub_epi8(x, b);
+			break;
+		case 3:
+			/* pavgb rounds up, floor it back */
+			avg = _mm_sub_epi8(_mm_avg_epu8(a, b),
+			    _mm_and_si128(_mm_xor_si128(a, b), one));
+			x = _mm_sub_epi8(x, avg);
+			break;
+		case 4:
+			c = _mm_loadu_si128((const __m128i *)
+			    (prev + i - bpp));
+			lo[0] = _mm_unpacklo_epi8(a, zero);
+			lo[1] = _mm_unpacklo_epi8(b, zero);
+			lo[2] = _mm_unpacklo_epi8(c, zero);
+			hi[0] = _mm_unpackhi_epi8(a, zero);
+			hi[1] = _mm_unpackhi_epi8(b, zero);
+			hi[2] = _mm_unpackhi_epi8(c, zero);
+			for (h = 0; h < 2; h++) {
+				__m128i	*v = 0 == h ? lo : hi;
+
+				/* |p - a| = |b - c| and so on */
+				p = _mm_sub_epi16(v[1], v[2]);
+				pa[h] = _mm_max_epi16(p,
+				    _mm_sub_epi16(_mm_setzero_si128(), p));
+				p = _mm_sub_epi16(v[0], v[2]);
+				pb[h] = _mm_max_epi16(p,
+				    _mm_sub_epi16(_mm_setzero_si128(), p));
+				p = _mm_sub_epi16(_mm_add_epi16(v[0], v[1]),
+				    _mm_add_epi16(v[2], v[2]));
+				pc[h] = _mm_max_epi16(p,
+				    _mm_sub_epi16(_mm_setzero_si128(), p));
+				na = _mm_or_si128(_mm_cmpgt_epi16(pa[h], pb[h]),
+				    _mm_cmpgt_epi16(pa[h], pc[h]));
+				nb = _mm_cmpgt_epi16(pb[h], pc[h]);
+				p = _mm_or_si128(_mm_andnot_si128(nb, v[1]),
+				    _mm_and_si128(nb, v[2]));
+				pr[h] = _mm_or_si128(_mm_andnot_si128(na, v[0]),
+				    _mm_and_si128(na, p));
+			}
+			x = _mm_sub_epi8(x, _mm_packus_epi16(pr[0], pr[1]));
+			break;
+		}
+		_mm_storeu_si128((__m128i *)(out + i), x);
+	}
+	return(i);
+}
+
+static unsigned long
+filter_sum_sse2(const uint8_t *out, size_t len, size_t *end)
+{
+	__m128i	v, acc, zero;
+	size_t	i;
+
+	zero = _mm_setzero_si128();
+	acc = zero;
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(out + i));
+		/* |v| as a signed byte is the smaller of v and -v */
+		v = _mm_min_epu8(v, _mm_sub_epi8(zero, v));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+	}
+	*end = i;
+	return((unsigned long)_mm_cvtsi128_si32(acc) +
+	    (unsigned long)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+}
+#endif
+
+/*
+ * Filter row with the given type into out.  Returns the sum of the
+ * filtered bytes taken as signed.
+ */
+static unsigned long
+filter_type(uint8_t *out, int type, const uint8_t *row, const uint8_t *prev,
+    size_t len, int bpp)
+{
+	size_t		 i, b;
+	unsigned long	 sum;
+
+	if (0 == type)
+		(void)memcpy(out, row, len);
+	b = (size_t)bpp < len ? (size_t)bpp : len;
+	switch (type) {
+	case 1:
+		for (i = 0; i < b; i++)
+			out[i] = row[i];
+		break;
+	case 2:
+		for (i = 0; i < b; i++)
+			out[i] = row[i] - prev[i];
+		break;
+	case 3:
+		for (i = 0; i < b; i++)
+			out[i] = row[i] - (prev[i] >> 1);
+		break;
+	case 4:
+		for (i = 0; i < b; i++)
+			out[i] = row[i] - prev[i];
+		break;
+	}
+	i = b;
+#if defined(__SSE2__)
+	if (0 != type)
+		i = filter_type_sse2(out, type, row, prev, i, len, b);
+#endif
+	switch (type) {
+	case 1:
+		for (; i < len; i++)
+			out[i] = row[i] - row[i - b];
+		break;
+	case 2:
+		for (; i < len; i++)
+			out[i] = row[i] - prev[i];
+		break;
+	case 3:
+		for (; i < len; i++)
+			out[i] = row[i] - ((row[i - b] + prev[i]) >> 1);
+		break;
+	case 4:
+		for (; i < len; i++)
+			out[i] = row[i] - paeth(row[i - b], prev[i],
+			    prev[i - b]);
+		break;
+	}
+
+	sum = 0;
+	i = 0;
+#if defined(__SSE2__)
+	sum = filter_sum_sse2(out, len, &i);
+#endif
+	for (; i < len; i++)
+		sum += abs((int8_t)out[i]);
+	return(sum);
+}
+
+/*
+ * Filter a row of len bytes with bpp bytes per pixel into out, filter
+ * type first, picking the filter with the smallest sum of absolute
+ * values like libpng does.  prev is the previous row, all zeroes for
+ * the first one.  Candidates are tried in out and in scratch, keeping
+ * the best so far in place.
+ */
+static void
+filter_row(uint8_t *out, uint8_t *scratch, const uint8_t *row,
+    const uint8_t *prev, size_t len, int bpp)
+{
+	uint8_t		*best, *try, *tmp;
+	int		 type, besttype;
+	unsigned long	 sum, min;
+
+	best = out + 1;
+	try = scratch;
+	besttype = 0;
+	min = filter_type(best, 0, row, prev, len, bpp);
+	for (type = 1; type < 5; type++) {
+		sum = filter_type(try, type, row, prev, len, bpp);
+		if (sum < min) {
+			min = sum;
+			besttype = type;
+			tmp = best;
+			best = try;
+			try = tmp;
+		}
+	}
+	if (best != out + 1)
+		(void)memcpy(out + 1, best, len);
+	out[0] = besttype;
+}
+
+#define ZPAR_DICT (32 * 1024)
+
+/*
+ * Deflate streams of finished blocks and images, kept to be reset rather
+ * than set up again: at level 6 zlib allocates and faults in about 256
+ * KiB for each new stream.  Shared by every thread of the process.
+ */
+#define ZPOOL_MAX 8
+
+static struct {
+	z_stream	*zs;
+	int		 level;
+	int		 bits;
+	int		 strategy;
+} zpool[ZPOOL_MAX];
+static size_t		zpooln;
+static pthread_mutex_t	zpool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A deflate stream with the given settings, out of the pool if one is
+ * there.  Returns NULL if unable to allocate one.
+ */
+static z_stream *
+zstream_get(int level, int bits, int strategy)
+{
+	z_stream	*zs;
+	size_t		 i;
+
+	zs = NULL;
+	pthread_mutex_lock(&zpool_lock);
+	for (i = 0; i < zpooln; i++) {
+		if (zpool[i].level != level || zpool[i].bits != bits ||
+		    zpool[i].strategy != strategy)
+			continue;
+		zs = zpool[i].zs;
+		zpool[i] = zpool[--zpooln];
+		break;
+	}
+	pthread_mutex_unlock(&zpool_lock);
+	if (NULL != zs) {
+		if (Z_OK == deflateReset(zs))
+			return(zs);
+		deflateEnd(zs);
+		free(zs);
+	}
+	if (NULL == (zs = calloc(1, sizeof(z_stream))))
+		return(NULL);
+	if (Z_OK != deflateInit2(zs, level, Z_DEFLATED, bits, 8, strategy)) {
+		free(zs);
+		return(NULL);
+	}
+	return(zs);
+}
+
+/*
+ * Hand a stream from zstream_get() back, to the pool if there is room.
+ */
+static void
+zstream_put(z_stream *zs, int level, int bits, int strategy)
+{
+	if (NULL == zs)
+		return;
+	pthread_mutex_lock(&zpool_lock);
+	if (zpooln < ZPOOL_MAX) {
+		zpool[zpooln].zs = zs;
+		zpool[zpooln].level = level;
+		zpool[zpooln].bits = bits;
+		zpool[zpooln].strategy = strategy;
+		zpooln++;
+		zs = NULL;
+	}
+	pthread_mutex_unlock(&zpool_lock);
+	if (NULL != zs) {
+		deflateEnd(zs);
+		free(zs);
+	}
+}
+
+struct zblock {
+	pthread_t	 thread;
+	int		 running;
+	int		 level;
+	int		 strategy;
+	int		 last;
+	uint8_t		*in;
+	size_t		 inz;
+	const uint8_t	*dict;
+	size_t		 dictz;
+	uint8_t		*out;
+	size_t		 outz;
+	uLong		 adler;
+	int		 rc;
+};
+
+struct zpar {
+	int		  level;
+	int		  strategy;
+	size_t		  blocksz;
+	int		  threads;
+	struct zblock	**blocks;
+	size_t		  blocksn;
+	uint8_t		 *cur;
+	size_t		  curz;
+};
+
+static void *
+zblock_main(void *arg)
+{
+	struct zblock	*b;
+	z_stream	*zs;
+
+	b = arg;
+	b->rc = -1;
+	b->adler = adler32(adler32(0, Z_NULL, 0), b->in, b->inz);
+	if (NULL == (zs = zstream_get(b->level, -15, b->strategy)))
+		return(NULL);
+	if (0 != b->dictz &&
+	    Z_OK != deflateSetDictionary(zs, b->dict, b->dictz))
+		goto out;
+	/* room for the empty stored block of the sync flush */
+	b->outz = deflateBound(zs, b->inz) + 16;
+	if (NULL == (b->out = malloc(b->outz)))
+		goto out;
+	zs->next_in = b->in;
+	zs->avail_in = b->inz;
+	zs->next_out = b->out;
+	zs->avail_out = b->outz;
+	if (b->last) {
+		if (Z_STREAM_END != deflate(zs, Z_FINISH))
+			goto out;
+	} else if (Z_OK != deflate(zs, Z_SYNC_FLUSH) || 0 == zs->avail_out)
+		goto out;
+	b->outz = zs->total_out;
+	b->rc = 0;
+out:
+	zstream_put(zs, b->level, -15, b->strategy);
+	return(NULL);
+}
+
+static void
+zblock_join(struct zblock *b)
+{
+	if (b->running) {
+		pthread_join(b->thread, NULL);
+		b->running = 0;
+	}
+}
+
+/*
+ * Start deflating the block being filled, on a thread of its own once
+ * fewer than threads blocks are in flight.
+ */
+static int
+zpar_dispatch(struct zpar *zp, int last)
+{
+	struct zblock	 *b, *prev, **blocks;
+
+	blocks = realloc(zp->blocks,
+	    (zp->blocksn + 1) * sizeof(struct zblock *));
+	if (NULL == blocks)
+		return(-1);
+	zp->blocks = blocks;
+	if (NULL == (b = calloc(1, sizeof(struct zblock))))
+		return(-1);
+	b->level = zp->level;
+	b->strategy = zp->strategy;
+	b->last = last;
+	b->in = zp->cur;
+	b->inz = zp->curz;
+	if (zp->blocksn > 0) {
+		prev = zp->blocks[zp->blocksn - 1];
+		b->dictz = prev->inz < ZPAR_DICT ? prev->inz : ZPAR_DICT;
+		b->dict = prev->in + prev->inz - b->dictz;
+	}
+	zp->blocks[zp->blocksn++] = b;
+	zp->cur = NULL;
+	zp->curz = 0;
+	if (zp->blocksn > (size_t)zp->threads)
+		zblock_join(zp->blocks[zp->blocksn - 1 - zp->threads]);
+	if (zp->threads > 1 && 0 == pthread_create(&b->thread, NULL,
+	    zblock_main, b))
+		b->running = 1;
+	else
+		zblock_main(b);
+	return(0);
+}
+
+struct zpar *
+zpar_new(int level, int strategy, size_t blocksz, int threads)
+{
+	struct zpar	*zp;
+
+	if (NULL == (zp = calloc(1, sizeof(struct zpar))))
+		return(NULL);
+	zp->level = level;
+	zp->strategy = strategy;
+	zp->blocksz = blocksz;
+	zp->threads = threads < 1 ? 1 : threads;
+	return(zp);
+}
+
+int
+zpar_write(struct zpar *zp, const uint8_t *data, size_t dataz)
+{
+	size_t	n;
+
+	while (dataz > 0) {
+		if (NULL == zp->cur &&
+		    NULL == (zp->cur = malloc(zp->blocksz)))
+			return(-1);
+		n = zp->blocksz - zp->curz;
+		n = dataz < n ? dataz : n;
+		(void)memcpy(zp->cur + zp->curz, data, n);
+		zp->curz += n;
+		data += n;
+		dataz -= n;
+		if (zp->curz == zp->blocksz && 0 != zpar_dispatch(zp, 0))
+			return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Deflate what is left and hand out the whole zlib stream.
+ */
+int
+zpar_finish(struct zpar *zp, uint8_t **out, size_t *outz)
+{
+	size_t		 i, len;
+	uLong		 adler;
+	uint8_t		*buf, flevel;
+	uint32_t	 trailer;
+
+	*out = NULL;
+	*outz = 0;
+	if (0 != zpar_dispatch(zp, 1))
+		return(-1);
+	len = 2 + 4;
+	for (i = 0; i < zp->blocksn; i++) {
+		zblock_join(zp->blocks[i]);
+		if (0 != zp->blocks[i]->rc)
+			return(-1);
+		len += zp->blocks[i]->outz;
+	}
+	if (NULL == (buf = malloc(len)))
+		return(-1);
+
+	/* zlib header, with the level hint zlib itself would give */
+	flevel = zp->level < 0 ? 2 : zp->level < 2 ? 0 :
+	    zp->level < 6 ? 1 : zp->level == 6 ? 2 : 3;
+	buf[0] = 0x78;
+	buf[1] = flevel << 6;
+	buf[1] += 31 - (buf[0] * 256 + buf[1]) % 31;
+	*outz = 2;
+	adler = adler32(0, Z_NULL, 0);
+	for (i = 0; i < zp->blocksn; i++) {
+		(void)memcpy(buf + *outz, zp->blocks[i]->out,
+		    zp->blocks[i]->outz);
+		*outz += zp->blocks[i]->outz;
+		adler = adler32_combine(adler, zp->blocks[i]->adler,
+		    zp->blocks[i]->inz);
+	}
+	trailer = htonl(adler);
+	(void)memcpy(buf + *outz, &trailer, sizeof(trailer));
+	*outz += sizeof(trailer);
+	*out = buf;
+	return(0);
+}
+
+void
+zpar_free(struct zpar *zp)
+{
+	size_t	i;
+
+	if (NULL == zp)
+		return;
+	for (i = 0; i < zp->blocksn; i++) {
+		zblock_join(zp->blocks[i]);
+		free(zp->blocks[i]->in);
+		free(zp->blocks[i]->out);
+		free(zp->blocks[i]);
+	}
+	free(zp->blocks);
+	free(zp->cur);
+	free(zp);
+}
+
+struct pngw {
+	uint8_t		*buf;
+	size_t		 bufz;
+	size_t		 bufmax;
+	size_t		 idat; /* offset of the streamed IDAT chunk */
+	uLong		 crc;
+	z_stream	*zs; /* while the IDAT chunk is open */
+	int		 zlevel;
+	int		 zbits;
+	int		 zstrategy;
+};
+
+static int
+pngw_reserve(struct pngw *w, size_t n)
+{
+	size_t	 max;
+	uint8_t	*buf;
+
+	if (w->bufmax - w->bufz >= n)
+		return(0);
+	max = w->bufmax;
+	while (max - w->bufz < n)
+		max *= 2;
+	if (NULL == (buf = realloc(w->buf, max)))
+		return(-1);
+	w->buf = buf;
+	w->bufmax = max;
+	return(0);
+}
+
+struct pngw *
+pngw_new(void)
+{
+	struct pngw	*w;
+
+	if (NULL == (w = calloc(1, sizeof(struct pngw))))
+		return(NULL);
+	w->bufmax = 1024;
+	if (NULL == (w->buf = malloc(w->bufmax))) {
+		free(w);
+		return(NULL);
+	}
+	w->bufz = write_png_sig(w->buf);
+	return(w);
+}
+
+int
+pngw_IHDR(struct pngw *w, size_t width, size_t height, int bitdepth,
+    enum colourtype colour)
+{
+	if (0 != pngw_reserve(w, 25))
+		return(-1);
+	w->bufz += write_IHDR(w->buf + w->bufz, width, height, bitdepth,
+	    colour);
+	return(0);
+}
+
+int
+pngw_chunk(struct pngw *w, const char *type, const uint8_t *data,
+    size_t dataz)
+{
+	uint32_t	crc, length;
+
+	if (NULL != w->zs || 0 != pngw_reserve(w, dataz + 12))
+		return(-1);
+	length = htonl(dataz);
+	(void)memcpy(w->buf + w->bufz, &length, sizeof(length));
+	(void)memcpy(w->buf + w->bufz + 4, type, 4);
+	if (0 != dataz)
+		(void)memcpy(w->buf + w->bufz + 8, data, dataz);
+	crc = crc32(crc32(0, Z_NULL, 0), w->buf + w->bufz + 4, dataz + 4);
+	crc = htonl(crc);
+	(void)memcpy(w->buf + w->bufz + 8 + dataz, &crc, sizeof(crc));
+	w->bufz += dataz + 12;
+	return(0);
+}
+
+/*
+ * Deflate data straight into the IDAT chunk at the end of the buffer,
+ * keeping its CRC up to date.
+ */
+static int
+pngw_deflate(struct pngw *w, const uint8_t *data, size_t dataz, int flush)
+{
+	size_t	avail, produced;
+	int	rc;
+
+	w->zs->next_in = (Bytef *)data;
+	w->zs->avail_in = dataz;
+	do {
+		if (0 != pngw_reserve(w, 1024))
+			return(-1);
+		avail = w->bufmax - w->bufz;
+		w->zs->next_out = w->buf + w->bufz;
+		w->zs->avail_out = avail;
+		rc = deflate(w->zs, flush);
+		if (Z_OK != rc && Z_STREAM_END != rc && Z_BUF_ERROR != rc)
+			return(-1);
+		produced = avail - w->zs->avail_out;
+		w->crc = crc32(w->crc, w->buf + w->bufz, produced);
+		w->bufz += produced;
+	} while (0 == w->zs->avail_out ||
+	    (Z_FINISH == flush && Z_STREAM_END != rc));
+	return(0);
+}
+
+int
+pngw_IDAT_start(struct pngw *w, int level, int bits, int strategy)
+{
+	if (NULL != w->zs ||
+	    NULL == (w->zs = zstream_get(level, bits, strategy)))
+		return(-1);
+	w->zlevel = level;
+	w->zbits = bits;
+	w->zstrategy = strategy;
+	if (0 != pngw_reserve(w, 8))
+		return(-1);
+	w->idat = w->bufz;
+	(void)memcpy(w->buf + w->bufz + 4, "IDAT", 4);
+	w->bufz += 8;
+	w->crc = crc32(crc32(0, Z_NULL, 0), (const Bytef *)"IDAT", 4);
+	return(0);
+}
+
+int
+pngw_IDAT_write(struct pngw *w, const uint8_t *data, size_t dataz)
+{
+	if (NULL == w->zs)
+		return(-1);
+	return(pngw_deflate(w, data, dataz, Z_NO_FLUSH));
+}
+
+/*
+ * Flush the stream and fill in the length and CRC of the IDAT chunk.
+ */
+int
+pngw_IDAT_end(struct pngw *w)
+{
+	size_t		idatz;
+	uint32_t	word;
+
+	if (NULL == w->zs || 0 != pngw_deflate(w, NULL, 0, Z_FINISH))
+		return(-1);
+	zstream_put(w->zs, w->zlevel, w->zbits, w->zstrategy);
+	w->zs = NULL;
+	idatz = w->bufz - w->idat - 8;
+	if (idatz > INT32_MAX || 0 != pngw_reserve(w, 4))
+		return(-1);
+	word = htonl(idatz);
+	(void)memcpy(w->buf + w->idat, &word, sizeof(word));
+	word = htonl(w->crc);
+	(void)memcpy(w->buf + w->bufz, &word, sizeof(word));
+	w->bufz += sizeof(word);
+	return(0);
+}
+
+/*
+ * Write IEND and hand out the buffer, trimmed to the size of the image,
+ * which the caller frees.
+ */
+int
+pngw_finish(struct pngw *w, uint8_t **out, size_t *outz)
+{
+	uint8_t	*buf;
+
+	*out = NULL;
+	*outz = 0;
+	if (NULL != w->zs || 0 != pngw_reserve(w, 12))
+		return(-1);
+	w->bufz += write_IEND(w->buf + w->bufz);
+	if (NULL != (buf = realloc(w->buf, w->bufz)))
+		w->buf = buf;
+	*out = w->buf;
+	*outz = w->bufz;
+	w->buf = NULL;
+	return(0);
+}
+
+void
+pngw_free(struct pngw *w)
+{
+	if (NULL == w)
+		return;
+	zstream_put(w->zs, w->zlevel, w->zbits, w->zstrategy);
+	free(w->buf);
+	free(w);
+}
+
+struct pngenc {
+	uint32_t	 width;
+	uint32_t	 height;
+	uint32_t	 y;
+	enum colourtype	 colour;
+	int		 bpp;
+	int		 inbpp;
+	size_t		 rowz;
+	uint8_t		*cur;
+	uint8_t		*prev;
+	uint8_t		*filtered;
+	uint8_t		*scratch;
+	struct pngw	*w;
+	int		 started;
+	struct zpar	*zpar;
+	size_t		 zblock;
+	int		 zthreads;
+};
+
+struct pngenc *
+pngenc_new(uint32_t width, uint32_t height, enum colourtype colour, int inbpp)
+{
+	struct pngenc	*enc;
+
+	if (NULL == (enc = calloc(1, sizeof(struct pngenc))))
+		return(NULL);
+	enc->width = width;
+	enc->height = height;
+	enc->colour = colour;
+	switch (colour) {
+	case COLOUR_TYPE_GREYSCALE_ALPHA:
+		enc->bpp = 2;
+		break;
+	case COLOUR_TYPE_TRUECOLOUR:
+		enc->bpp = 3;
+		break;
+	case COLOUR_TYPE_TRUECOLOUR_ALPHA:
+		enc->bpp = 4;
+		break;
+	default:
+		enc->bpp = 1;
+		break;
+	}
+	enc->inbpp = inbpp < enc->bpp ? enc->bpp : inbpp;
+	enc->rowz = (size_t)width * enc->bpp;
+	enc->cur = malloc(enc->rowz);
+	enc->prev = calloc(1, enc->rowz);
+	enc->filtered = malloc(enc->rowz + 1);
+	enc->scratch = malloc(enc->rowz);
+	enc->w = pngw_new();
+	if (NULL == enc->cur || NULL == enc->prev || NULL == enc->filtered ||
+	    NULL == enc->scratch || NULL == enc->w ||
+	    0 != pngw_IHDR(enc->w, width, height, 8, colour)) {
+		pngenc_free(enc);
+		return(NULL);
+	}
+	return(enc);
+}
+
+int
+pngenc_PLTE(struct pngenc *enc, const struct PLTE *plte)
+{
+	size_t	i;
+	uint8_t	data[256 * 3];
+
+	if (plte->entriesz > 256)
+		return(-1);
+	for (i = 0; i < plte->entriesz; i++) {
+		data[i * 3] = plte->entries[i].red;
+		data[i * 3 + 1] = plte->entries[i].green;
+		data[i * 3 + 2] = plte->entries[i].blue;
+	}
+	return(pngw_chunk(enc->w, "PLTE", data, plte->entriesz * 3));
+}
+
+int
+pngenc_tRNS(struct pngenc *enc, const uint8_t *trns, size_t trnsz)
+{
+	return(pngw_chunk(enc->w, "tRNS", trns, trnsz));
+}
+
+void
+pngenc_zpar(struct pngenc *enc, size_t blocksz, int threads)
+{
+	enc->zblock = blocksz;
+	enc->zthreads = threads;
+}
+
+/*
+ * Set up compression before the first row: blocks deflated in parallel
+ * when there are threads and enough data for it, or else a stream into
+ * an IDAT chunk whose length is filled in at the end.  Small images get
+ * a window no larger than their data, as in libpng.
+ */
+static int
+pngenc_start(struct pngenc *enc)
+{
+	uint64_t	rawz;
+	int		bits;
+
+	enc->started = 1;
+	rawz = (uint64_t)enc->height * (enc->rowz + 1);
+	if (enc->zthreads > 1 && rawz >= 2 * (uint64_t)enc->zblock) {
+		enc->zpar = zpar_new(6, Z_FILTERED, enc->zblock,
+		    enc->zthreads);
+		return(NULL == enc->zpar ? -1 : 0);
+	}
+	for (bits = 9; bits < 15 && ((uint64_t)1 << bits) < rawz; bits++)
+		continue;
+	return(pngw_IDAT_start(enc->w, 6, bits,
+	    COLOUR_TYPE_INDEXED == enc->colour ? Z_DEFAULT_STRATEGY :
+	    Z_FILTERED));
+}
+
+int
+pngenc_rows(struct pngenc *enc, uint8_t **rows, size_t n)
+{
+	uint8_t		*tmp;
+	size_t		 i, x;
+	int		 rc;
+
+	if (!enc->started && 0 != pngenc_start(enc))
+		return(-1);
+	if (n > enc->height - enc->y)
+		return(-1);
+	for (i = 0; i < n; i++) {
+		if (enc->inbpp == enc->bpp)
+			(void)memcpy(enc->cur, rows[i], enc->rowz);
+		else
+			for (x = 0; x < enc->width; x++)
+				(void)memcpy(enc->cur + x * enc->bpp,
+				    rows[i] + x * enc->inbpp, enc->bpp);
+		/* palette indices do not filter well */
+		if (COLOUR_TYPE_INDEXED == enc->colour) {
+			enc->filtered[0] = 0;
+			(void)memcpy(enc->filtered + 1, enc->cur, enc->rowz);
+		} else
+			filter_row(enc->filtered, enc->scratch, enc->cur,
+			    enc->prev, enc->rowz, enc->bpp);
+		if (NULL != enc->zpar)
+			rc = zpar_write(enc->zpar, enc->filtered,
+			    enc->rowz + 1);
+		else
+			rc = pngw_IDAT_write(enc->w, enc->filtered,
+			    enc->rowz + 1);
+		if (0 != rc)
+			return(-1);
+		tmp = enc->prev;
+		enc->prev = enc->cur;
+		enc->cur = tmp;
+		enc->y++;
+	}
+	return(0);
+}
+
+/*
+ * Close the image after its last row and hand out the buffer, which the
+ * caller frees.
+ */
+int
+pngenc_finish(struct pngenc *enc, uint8_t **out, size_t *outz)
+{
+	uint8_t		*idat;
+	size_t		 idatz;
+	int		 rc;
+
+	*out = NULL;
+	*outz = 0;
+	if (enc->y != enc->height)
+		return(-1);
+	if (!enc->started && 0 != pngenc_start(enc))
+		return(-1);
+	if (NULL != enc->zpar) {
+		if (0 != zpar_finish(enc->zpar, &idat, &idatz))
+			return(-1);
+		rc = pngw_chunk(enc->w, "IDAT", idat, idatz);
+		free(idat);
+		if (0 != rc)
+			return(-1);
+	} else if (0 != pngw_IDAT_end(enc->w))
+		return(-1);
+	return(pngw_finish(enc->w, out, outz));
+}
+
+void
+pngenc_free(struct pngenc *enc)
+{
+	if (NULL == enc)
+		return;
+	pngw_free(enc->w);
+	zpar_free(enc->zpar);
+	free(enc->cur);
+	free(enc->prev);
+	free(enc->filtered);
+	free(enc->scratch);
+	free(enc);
+}
@@ -93,7 +93,58 @@ struct PLTE {
 };
 
 size_t		write_png_sig(uint8_t *);
-size_t		write_IHDR(uint8_t *, size_t, int, enum colourtype);
+size_t		write_IHDR(uint8_t *, size_t, size_t, int, enum colourtype);
 size_t		write_IEND(uint8_t *);
 
+/*
+ * Chunk writer into a memory buffer that grows as needed and starts
+ * with the PNG signature.  Image data is deflated as it comes between
+ * pngw_IDAT_start() and pngw_IDAT_end() into a single IDAT chunk, whose
+ * length and CRC are filled in at the end.  pngw_finish() adds IEND and
+ * hands out a buffer of the exact size of the image.
+ */
+struct pngw;
+
+struct pngw	*pngw_new(void);
+int		 pngw_IHDR(struct pngw *, size_t, size_t, int, enum colourtype);
+int		 pngw_chunk(struct pngw *, const char *, const uint8_t *,
+		    size_t);
+int		 pngw_IDAT_start(struct pngw *, int, int, int);
+int		 pngw_IDAT_write(struct pngw *, const uint8_t *, size_t);
+int		 pngw_IDAT_end(struct pngw *);
+int		 pngw_finish(struct pngw *, uint8_t **, size_t *);
+void		 pngw_free(struct pngw *);
+
+/*
+ * Build a zlib stream out of blocks deflated on their own threads, the
+ * way pigz does: each block is primed with the last 32 KiB of input of
+ * the block before it and ends on a sync flush, so that the raw deflate
+ * outputs can be concatenated into a single stream.
+ */
+struct zpar;
+
+struct zpar	*zpar_new(int, int, size_t, int);
+int		 zpar_write(struct zpar *, const uint8_t *, size_t);
+int		 zpar_finish(struct zpar *, uint8_t **, size_t *);
+void		 zpar_free(struct zpar *);
+
+/*
+ * Streaming encoder of 8-bit non-interlaced images into a memory buffer.
+ * Rows are filtered with the best of the five filters per row, palette
+ * ones excepted, and deflated as they come into a single IDAT chunk.
+ * Rows handed in may have more bytes per pixel than the colour type,
+ * the extra trailing ones are dropped.  PLTE and tRNS go before the
+ * first row, pngenc_zpar() too if large images are to be deflated in
+ * parallel blocks.
+ */
+struct pngenc;
+
+struct pngenc	*pngenc_new(uint32_t, uint32_t, enum colourtype, int);
+int		 pngenc_PLTE(struct pngenc *, const struct PLTE *);
+int		 pngenc_tRNS(struct pngenc *, const uint8_t *, size_t);
+void		 pngenc_zpar(struct pngenc *, size_t, int);
+int		 pngenc_rows(struct pngenc *, uint8_t **, size_t);
+int		 pngenc_finish(struct pngenc *, uint8_t **, size_t *);
+void		 pngenc_free(struct pngenc *);
+
 #endif
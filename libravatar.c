@@ -32,6 +32,7 @@
 #include <kcgihtml.h>
 
 #include "libravatar.h"
+#include "defaults_tables.h"
 
 enum page {
 	PAGE_INDEX,
@@ -152,6 +153,59 @@ page_index(struct kreq *r)
 	khtml_close(&h);
 }
 
+/*
+ * Serve one of the prebuilt images.  Its length and ETag are known, so
+ * conditional requests are answered without a body and the image is
+ * sent as is rather than compressed again.
+ */
+static void
+page_embedded(struct kreq *r, const struct embedded *png)
+{
+	struct khead	*inm;
+
+	inm = r->reqmap[KREQU_IF_NONE_MATCH];
+	if (NULL != inm && 0 == strcmp(inm->val, png->etag)) {
+		khttp_head(r, kresps[KRESP_STATUS],
+		    "%s", khttps[KHTTP_304]);
+		khttp_head(r, kresps[KRESP_ETAG], "%s", png->etag);
+		khttp_head(r, kresps[KRESP_CACHE_CONTROL], "max-age=86400");
+		khttp_body(r);
+		return;
+	}
+	khttp_head(r, kresps[KRESP_STATUS],
+	    "%s", khttps[KHTTP_200]);
+	khttp_head(r, kresps[KRESP_CONTENT_TYPE],
+	    "%s", kmimetypes[KMIME_IMAGE_PNG]);
+	khttp_head(r, kresps[KRESP_CONTENT_LENGTH], "%zu", png->dataz);
+	khttp_head(r, kresps[KRESP_ETAG], "%s", png->etag);
+	khttp_head(r, kresps[KRESP_ACCESS_CONTROL_ALLOW_ORIGIN], "*");
+	khttp_head(r, kresps[KRESP_CACHE_CONTROL], "max-age=86400");
+	khttp_body_compress(r, 0);
+	khttp_write(r, (const char *)png->data, png->dataz);
+}
+
+/*
+ * Serve the default image from its prescaled ladder, if there is one
+ * that is up to date.
+ */
+static int
+page_ladder(struct kreq *r, size_t size)
+{
+	struct ladder	 ladder;
+	struct embedded	 png;
+	char		 etag[64];
+
+	if (0 != ladder_open(&ladder, _PATH_DEFAULT, _PATH_LADDER))
+		return(-1);
+	if (0 != ladder_get(&ladder, size, &png, etag, sizeof(etag))) {
+		ladder_close(&ladder);
+		return(-1);
+	}
+	page_embedded(r, &png);
+	ladder_close(&ladder);
+	return(0);
+}
+
 static void
 page_avatar(struct kreq *r)
 {
@@ -178,19 +232,11 @@ page_avatar(struct kreq *r)
 			http_start(r, KHTTP_404);
 			return;
 		case DEFAULT_BLANK:
-			if (-1 == blank(avatar->s, &data, &dataz)) {
-				http_start(r, KHTTP_500);
-				return;
-			}
-			mime = KMIME_IMAGE_PNG;
-			break;
+			page_embedded(r, &blank_pngs[avatar->s - 1]);
+			return;
 		case DEFAULT_MM:
-			if (-1 == mm(avatar->s, &data, &dataz)) {
-				http_start(r, KHTTP_500);
-				return;
-			}
-			mime = KMIME_IMAGE_PNG;
-			break;
+			page_embedded(r, &mm_pngs[avatar->s - 1]);
+			return;
 		case DEFAULT_URL:
 			khttp_head(r, kresps[KRESP_STATUS],
 			    "%s", khttps[KHTTP_307]);
@@ -199,6 +245,8 @@ page_avatar(struct kreq *r)
 			khttp_body(r);
 			return;
 		default:
+			if (0 == page_ladder(r, avatar->s))
+				return;
 			if (NULL == (s = fopen(_PATH_DEFAULT, "r"))) {
 				http_start(r, KHTTP_500);
 				return;
@@ -209,7 +257,8 @@ page_avatar(struct kreq *r)
 	}
 	/* Only resize if an image is found or if the default one is served */
 	if (NULL != s || DEFAULT_NONE == avatar->d) {
-		if (0 == (dataz = pngscale(s, &data, avatar->s))) {
+		if (0 == (dataz = pngscale(s, &data, avatar->s,
+		    PNGSCALE_ONLINE))) {
 			fclose(s);
 			http_start(r, KHTTP_500);
 			return;
@@ -242,7 +291,8 @@ sanitize(struct kreq *r)
 	for (i = 0; i < r->fieldsz; i++) {
 		if (strcmp(r->fields[i].key, "s") == 0
 		    || strcmp(r->fields[i].key, "size") == 0) {
-			avatar->s = strtonum(r->fields[i].val, 1, 512, &err);
+			avatar->s = strtonum(r->fields[i].val, 1,
+			    AVATAR_MAX_SIZE, &err);
 			if (err != NULL)
 				avatar->s = 80;
 		} else if (strcmp(r->fields[i].key, "d") == 0
@@ -2,9 +2,107 @@
 #define LIBRAVATAR_H_
 
 #define _PATH_DEFAULT "/htdocs/avatars/default.png"
+#define _PATH_LADDER "/htdocs/avatars/default.ladder"
 
-size_t pngscale(FILE *, unsigned char **, uint32_t);
+/*
+ * pngscale() spreads the resampling of large sources over up to
+ * PNGSCALE_MAX_THREADS threads, one per PNGSCALE_MT_PIXELS input pixels,
+ * so that a single request cannot starve concurrent ones.
+ */
+#define PNGSCALE_MAX_THREADS 4
+#define PNGSCALE_MT_PIXELS (1024 * 1024)
+
+/*
+ * Number of output rows pngscale() scales and hands to the encoder at
+ * once.
+ */
+#define PNGSCALE_BATCH 16
+
+/*
+ * Past this many source plus output pixels, pngscale() decodes, scales
+ * and encodes on three threads, handing rows over in batches of
+ * PNGSCALE_BATCH through rings of PNGSCALE_PIPE_SLOTS batches.  Two of
+ * the threads count against PNGSCALE_MAX_THREADS.
+ */
+#define PNGSCALE_PIPE_PIXELS (1024 * 1024)
+#define PNGSCALE_PIPE_SLOTS 4
+
+/*
+ * Outputs of at least two PNGSCALE_ZPAR_BLOCK bytes of filtered rows are
+ * deflated in blocks of that size on their own threads rather than as a
+ * single stream.  Those threads come out of PNGSCALE_MAX_THREADS too:
+ * they get whatever the scaler, the pipeline and the calling thread
+ * left of it, and no more than one per online CPU.
+ */
+#define PNGSCALE_ZPAR_BLOCK (128 * 1024)
+
+/*
+ * How pngscale() fits non-square sources to a square output.  With
+ * PNGSCALE_FIT the whole source is kept and the output shrinks along
+ * its short side.  The other gravities crop the source to a square
+ * first: NORTH and SOUTH keep the top or bottom of portrait sources,
+ * WEST and EAST the left or right of landscape ones, and the crop is
+ * centered along the other axis.
+ */
+enum pngscale_gravity {
+	PNGSCALE_FIT,
+	PNGSCALE_CENTER,
+	PNGSCALE_NORTH,
+	PNGSCALE_SOUTH,
+	PNGSCALE_WEST,
+	PNGSCALE_EAST
+};
+
+#define PNGSCALE_GRAVITY PNGSCALE_CENTER
+
+/*
+ * Code paths calling pngscale().  Each picks its own resampling filter
+ * per output size band, see the table in pngscale.c.
+ */
+enum pngscale_path {
+	PNGSCALE_ONLINE, /* rendered while the client waits */
+	PNGSCALE_LADDER /* prerendered once, quality first */
+};
+
+size_t pngscale(FILE *, unsigned char **, uint32_t, enum pngscale_path);
+
+/*
+ * Scale one source to n sizes, decoding it once.  Each output gets its
+ * own PNG in outputs[i], outputz[i], the same as pngscale() renders it.
+ * Returns 0 on success, -1 with every output NULL otherwise.
+ */
+int pngscale_multi(FILE *, const uint32_t *, size_t, unsigned char **,
+    size_t *, enum pngscale_path);
 int blank(size_t, uint8_t **, size_t *);
 int mm(size_t, uint8_t **, size_t *);
 
+/* Largest size a client can ask for */
+#define AVATAR_MAX_SIZE 512
+
+/*
+ * The blank and mm images are pure functions of the size, so all of them
+ * are built once by defaults_gentables into defaults_tables.h.
+ */
+struct embedded {
+	const unsigned char	*data;
+	size_t			 dataz;
+	const char		*etag;
+};
+
+/*
+ * The default image prescaled to every size by mkladder into a file
+ * that is mapped and served from directly.  It is only used while it
+ * matches the size and modification time of the default image.
+ */
+struct ladder {
+	const unsigned char	*map;
+	size_t			 mapz;
+};
+
+int ladder_build(const char *, const char *);
+int ladder_open(struct ladder *, const char *, const char *);
+int ladder_get(const struct ladder *, size_t, struct embedded *, char *,
+    size_t);
+void ladder_close(struct ladder *);
+
 #endif /* LIBRAVATAR_H_ */
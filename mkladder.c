@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2018 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Prescale the default image to every size into the ladder file served
+ * by libravatar.cgi, see ladder.c.  Run again whenever the default image
+ * changes, the CGI ignores a ladder built from another one.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libravatar.h"
+
+int
+main(int argc, char *argv[])
+{
+	if (3 != argc) {
+		fprintf(stderr, "usage: mkladder default.png default.ladder\n");
+		return(EXIT_FAILURE);
+	}
+	if (0 != ladder_build(argv[1], argv[2]))
+		errx(EXIT_FAILURE, "unable to build %s from %s", argv[2],
+		    argv[1]);
+	return(EXIT_SUCCESS);
+}
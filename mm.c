@@ -28,8 +28,6 @@
 #include "libravatar.h"
 #include "lgpng.h"
 
-#define PNGMM_MAX_SIZE 1500
-
 static int
 palette_init(struct PLTE *plte, size_t n)
 {
@@ -58,45 +56,97 @@ palette_free(struct PLTE *plte)
 	plte->entriesz = 0;
 }
 
-static size_t
-write_PLTE(struct PLTE *plte, uint8_t *buf)
+static int
+write_PLTE(struct PLTE *plte, struct pngw *w)
 {
-	uint32_t	crc, length;
-	size_t		bufw;
-	uint8_t		type[4] = "PLTE";
+	uint8_t		data[256 * sizeof(struct rgb8)];
+	size_t		dataz;
 
-	length = htonl(plte->entriesz * sizeof(*(plte->entries)));
-	crc = crc32(0, Z_NULL, 0);
-	crc = crc32(crc, type, sizeof(type));
+	if (plte->entriesz > 256)
+		return(-1);
+	dataz = 0;
 	for (size_t i = 0; i < plte->entriesz; i++) {
-		crc = crc32(crc, (Bytef *)&(plte->entries[i]),
-		    sizeof(plte->entries[i]));
+		data[dataz++] = plte->entries[i].red;
+		data[dataz++] = plte->entries[i].green;
+		data[dataz++] = plte->entries[i].blue;
 	}
-	crc = htonl(crc);
-	bufw = 0;
-	(void)memcpy(buf + bufw, &length, sizeof(length));
-	bufw += sizeof(length);
-	(void)memcpy(buf + bufw, type, sizeof(type));
-	bufw += sizeof(type);
-	for (size_t i = 0; i < plte->entriesz; i++) {
-		(void)memcpy(buf + bufw, &(plte->entries[i]),
-		    sizeof(plte->entries[i]));
-		bufw += sizeof(plte->entries[i]);
+	return(pngw_chunk(w, "PLTE", data, dataz));
+}
+
+/* Rounding towards minus infinity, b > 0 */
+static long
+floordiv(long a, long b)
+{
+	return(a >= 0 ? a / b : -((-a + b - 1) / b));
+}
+
+/*
+ * Narrow the span [*lo, *hi] to the values of fx for which
+ * a * fx + b > 0.
+ */
+static void
+span_positive(long a, long b, long *lo, long *hi)
+{
+	long	bound;
+
+	if (0 == a) {
+		if (b <= 0)
+			*hi = *lo - 1;
+	} else if (a > 0) {
+		/* fx > -b / a */
+		bound = floordiv(-b, a) + 1;
+		if (bound > *lo)
+			*lo = bound;
+	} else {
+		/* fx < b / -a */
+		bound = -floordiv(-b, -a) - 1;
+		if (bound < *hi)
+			*hi = bound;
+	}
+}
+
+/* Integer square root */
+static long
+isqrt(long v)
+{
+	long	r;
+
+	r = (long)sqrt((double)v);
+	while (r * r > v)
+		r--;
+	while ((r + 1) * (r + 1) <= v)
+		r++;
+	return(r);
+}
+
+/* Set the bits of pixels lo to hi, included, of a 1-bit scanline */
+static void
+fill_span(uint8_t *row, long lo, long hi, long width)
+{
+	long	lob, hib;
+
+	if (lo < 0)
+		lo = 0;
+	if (hi > width - 1)
+		hi = width - 1;
+	if (lo > hi)
+		return;
+	lob = lo / 8;
+	hib = hi / 8;
+	if (lob == hib) {
+		row[lob] |= (0xff >> (lo % 8)) & (0xff << (7 - hi % 8));
+		return;
 	}
-	(void)memcpy(buf + bufw, &crc, sizeof(crc));
-	bufw += sizeof(crc);
-	return(bufw);
+	row[lob] |= 0xff >> (lo % 8);
+	(void)memset(row + lob + 1, 0xff, hib - lob - 1);
+	row[hib] |= 0xff << (7 - hi % 8);
 }
 
-static size_t
-write_IDAT(uint8_t *buf, size_t width)
+static int
+write_IDAT(struct pngw *w, size_t width)
 {
-	size_t		 dataz, deflatez;
-	uint32_t	 crc, length;
-	size_t		 bufw;
-	uint8_t		 type[4] = "IDAT";
-	uint8_t		*data, *deflate;
-	int		 extrabyte, scanline;
+	uint8_t		*data;
+	int		 extrabyte, scanline, rc;
 	int		 radius, cx, cy;
 	int		 area, p0x, p0y, p1x, p1y, p2x, p2y;
 
@@ -119,84 +169,62 @@ write_IDAT(uint8_t *buf, size_t width)
 	scanline = width / 8 + extrabyte;
 	/* each scanline has one leading byte used to store filtering flags */
 	scanline += 1;
-	dataz = scanline * width;
-	if (NULL == (data = calloc(dataz, 1))) {
+	if (NULL == (data = malloc(scanline))) {
 		return(-1);
 	}
-	for (size_t y = 0; y < width; y++) {
-		for (size_t x = 0; x < width; x++) {
-			int value, byte, bit;
-			long fx, fy;
-
-			fx = x - cx;
-			fy = y - cy;
-			value = 0;
-			if (pow(fx, 2) + pow(fy, 2) - pow(radius, 2) <= 0) {
-				/* the current pixel is part of the circle */
-				value = 1;
-			} else {
-				/* or perhaps part of the triangle */
-				int s, t;
-                        
-				s = p2y * fx + (-p2x) * fy;
-				t = -p1y * fx + (p1x) * fy;
-				if (s > 0 && t > 0 && (s + t) < 2 * area) {
-					value = 1;
-				}
-			}
-			byte = y * scanline + (x / 8) + 1;
-			bit = x % 8;
-			data[byte] |= value << (7 - bit);
+	rc = pngw_IDAT_start(w, Z_DEFAULT_COMPRESSION, 15,
+	    Z_DEFAULT_STRATEGY);
+	for (size_t y = 0; 0 == rc && y < width; y++) {
+		long fy, lo, hi, d;
+
+		(void)memset(data, 0, scanline);
+		fy = (long)y - cy;
+		/* the chord of the circle, fx^2 + fy^2 <= radius^2 */
+		if (fy * fy <= (long)radius * radius) {
+			d = isqrt((long)radius * radius - fy * fy);
+			fill_span(data + 1, cx - d, cx + d, width);
 		}
+		/*
+		 * and the inside of the triangle, where s > 0, t > 0 and
+		 * s + t < 2 * area, each of them linear in fx
+		 */
+		lo = -cx;
+		hi = (long)width - 1 - cx;
+		span_positive(p2y, -p2x * fy, &lo, &hi);
+		span_positive(-p1y, p1x * fy, &lo, &hi);
+		span_positive(p1y - p2y, 2L * area - (p1x - p2x) * fy,
+		    &lo, &hi);
+		fill_span(data + 1, cx + lo, cx + hi, width);
+		rc = pngw_IDAT_write(w, data, scanline);
 	}
-	deflatez = compressBound(dataz);
-	if (NULL == (deflate = calloc(deflatez, 1))) {
-		free(data);
-		return(-1);
-	}
-	if (Z_OK != compress(deflate, &deflatez, data, dataz)) {
+	free(data);
+	if (0 != rc) {
 		return(-1);
 	}
-	free(data);
-	length = htonl(deflatez);
-	crc = crc32(0, Z_NULL, 0);
-	crc = crc32(crc, type, sizeof(type));
-	crc = crc32(crc, deflate, deflatez);
-	crc = htonl(crc);
-	bufw = 0;
-	(void)memcpy(buf + bufw, &length, sizeof(length));
-	bufw += sizeof(length);
-	(void)memcpy(buf + bufw, type, sizeof(type));
-	bufw += sizeof(type);
-	(void)memcpy(buf + bufw, deflate, deflatez);
-	bufw += deflatez;
-	(void)memcpy(buf + bufw, &crc, sizeof(crc));
-	bufw += sizeof(crc);
-	free(deflate);
-	return(bufw);
+	return(pngw_IDAT_end(w));
 }
 
 int
 mm(size_t width, uint8_t **buf, size_t *bufz)
 {
 	struct PLTE	 plte;
+	struct pngw	*w;
+	int		 rc;
 
-	if (NULL == ((*buf) = calloc(PNGMM_MAX_SIZE, 1))) {
+	if (-1 == palette_init(&plte, 2)) {
 		return(-1);
 	}
-	if (-1 == palette_init(&plte, 2)) {
-		free(*buf);
+	if (NULL == (w = pngw_new())) {
+		palette_free(&plte);
 		return(-1);
 	}
 	palette_assign(&plte, 0, 169, 169, 169);
 	palette_assign(&plte, 1,  255, 255, 255);
-	*bufz = 0;
-	*bufz += write_png_sig(*buf);
-	*bufz += write_IHDR(*buf + *bufz, width, 1, COLOUR_TYPE_INDEXED);
-	*bufz += write_PLTE(&plte, *buf + *bufz);
+	rc = -1;
+	if (0 == pngw_IHDR(w, width, width, 1, COLOUR_TYPE_INDEXED) &&
+	    0 == write_PLTE(&plte, w) && 0 == write_IDAT(w, width))
+		rc = pngw_finish(w, buf, bufz);
 	palette_free(&plte);
-	*bufz += write_IDAT(*buf + *bufz, width);
-	*bufz += write_IEND(*buf + *bufz);
-	return(0);
+	pngw_free(w);
+	return(rc);
 }
-
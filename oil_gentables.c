@@ -0,0 +1,161 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/**
+ * Build-time generator for the lookup tables used by oil_resample.c. Its
+ * output is written to oil_tables.h, which ends up as const data in the
+ * read-only segment instead of being computed by every process on startup.
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+/**
+ * Pre-calculated table of linear to srgb mappings.
+ *
+ * catmull-rom interpolation can produce values from -17/64 to 81/64.
+ *
+ * The total allocated space will be split into three parts:
+ *   * 17/98 of padding below zero
+ *   * 64/98 of mapping
+ *   * 17/98 of padding above one
+ */
+#define L2S_ALL_LEN 32768
+#define L2S_PADDING (L2S_ALL_LEN * 17 / 98)
+#define L2S_LEN (L2S_ALL_LEN - 2 * L2S_PADDING)
+
+static unsigned char l2s_map_all[L2S_ALL_LEN];
+static float s2l_map[256];
+static unsigned short s2l16_map[256];
+static float i2f_map[256];
+
+static void build_l2s(void)
+{
+	int i;
+	double srgb_f, tmp, val;
+	unsigned char *l2s_map;
+
+	l2s_map = l2s_map_all + L2S_PADDING;
+
+	for (i=0; i<L2S_LEN; i++) {
+		srgb_f = (i + 0.5)/(L2S_LEN - 1);
+		if (srgb_f <= 0.00313) {
+			val = srgb_f * 12.92;
+		} else {
+			tmp = pow(srgb_f, 1/2.4);
+			val = 1.055 * tmp - 0.055;
+		}
+
+		l2s_map[i] = round(val * 255);
+	}
+
+	for (i=0; i<L2S_PADDING; i++) {
+		l2s_map[L2S_LEN + i] = 255;
+	}
+}
+
+/**
+ * Populates s2l_map, the sRGB chars to linear RGB floats mapping, and its
+ * 16-bit fixed point counterpart s2l16_map used for integer box filtering.
+ */
+static void build_s2l(void)
+{
+	int input;
+	double in_f, tmp, val;
+
+	for (input=0; input<=255; input++) {
+		in_f = input / 255.0;
+		if (in_f <= 0.040448236277) {
+			val = in_f / 12.92;
+		} else {
+			tmp = ((in_f + 0.055)/1.055);
+			val = pow(tmp, 2.4);
+		}
+		s2l_map[input] = val;
+		s2l16_map[input] = round(val * 65535);
+	}
+}
+
+static void build_i2f(void)
+{
+	int i;
+
+	for (i=0; i<=255; i++) {
+		i2f_map[i] = i / 255.0f;
+	}
+}
+
+/**
+ * Floats are printed as hexadecimal literals so that the compiled tables are
+ * bit-for-bit identical to the ones computed at runtime.
+ */
+static void print_floats(const char *name, const float *map, int len)
+{
+	int i;
+
+	printf("static const float %s[%d] = {\n", name, len);
+	for (i=0; i<len; i++) {
+		printf("%s%af,%s", i % 4 ? " " : "\t", map[i],
+			i % 4 == 3 ? "\n" : "");
+	}
+	printf("};\n\n");
+}
+
+static void print_shorts(const char *name, const unsigned short *map, int len)
+{
+	int i;
+
+	printf("static const unsigned short %s[%d] = {\n", name, len);
+	for (i=0; i<len; i++) {
+		printf("%s%d,%s", i % 8 ? " " : "\t", map[i],
+			i % 8 == 7 ? "\n" : "");
+	}
+	printf("};\n\n");
+}
+
+static void print_bytes(const char *name, const unsigned char *map, int len)
+{
+	int i;
+
+	printf("static const unsigned char %s[%d] = {\n", name, len);
+	for (i=0; i<len; i++) {
+		printf("%s%d,%s", i % 16 ? " " : "\t", map[i],
+			i % 16 == 15 ? "\n" : "");
+	}
+	printf("};\n\n");
+}
+
+int main(void)
+{
+	build_s2l();
+	build_l2s();
+	build_i2f();
+
+	printf("/* Generated by oil_gentables, do not edit. */\n\n");
+	printf("#define L2S_ALL_LEN %d\n", L2S_ALL_LEN);
+	printf("#define L2S_PADDING %d\n", L2S_PADDING);
+	printf("#define L2S_LEN %d\n\n", L2S_LEN);
+	print_floats("s2l_map", s2l_map, 256);
+	print_shorts("s2l16_map", s2l16_map, 256);
+	print_floats("i2f_map", i2f_map, 256);
+	print_bytes("l2s_map_all", l2s_map_all, L2S_ALL_LEN);
+	return 0;
+}
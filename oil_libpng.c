@@ -21,6 +21,13 @@
 
 #include "oil_libpng.h"
 #include <stdlib.h>
+#include <string.h>
+
+/**
+ * Number of rows read from libpng at once. Enough to cover the vertical
+ * filter of most downscales in a single call.
+ */
+#define BATCH_ROWS 16
 
 static unsigned char **alloc_full_image_buf(int height, int rowbytes)
 {
@@ -53,61 +60,407 @@ static void free_full_image_buf(unsigned char **imgbuf, int height)
 	free(imgbuf);
 }
 
-int oil_libpng_init(struct oil_libpng *ol, png_structp rpng, png_infop rinfo,
-	int out_width, int out_height)
+/**
+ * (Re)allocate the contiguous block that input rows are read into.
+ */
+static int alloc_block(struct oil_libpng *ol, int batch)
+{
+	int i, buf_len, offset;
+	unsigned char *inbuf, **inrows, **croprows;
+
+	buf_len = ol->dec->rowbytes;
+	offset = ol->crop_x * OIL_CMP(ol->dec->cs);
+	inbuf = malloc(batch * buf_len);
+	inrows = malloc(batch * sizeof(unsigned char *));
+	croprows = malloc(batch * sizeof(unsigned char *));
+	if (!inbuf || !inrows || !croprows) {
+		free(inbuf);
+		free(inrows);
+		free(croprows);
+		return -2;
+	}
+	for (i=0; i<batch; i++) {
+		inrows[i] = inbuf + i * buf_len;
+		croprows[i] = inrows[i] + offset;
+	}
+	free(ol->inbuf);
+	free(ol->inrows);
+	free(ol->croprows);
+	ol->inbuf = inbuf;
+	ol->inrows = inrows;
+	ol->croprows = croprows;
+	ol->batch = batch;
+	return 0;
+}
+
+/**
+ * Point the rows handed to the scaler at the crop window of the full image.
+ */
+static int crop_image(struct oil_libpng *ol, int height)
+{
+	int i, offset;
+
+	offset = ol->crop_x * OIL_CMP(ol->dec->cs);
+	ol->croprows = malloc(height * sizeof(unsigned char *));
+	if (!ol->croprows) {
+		return -2;
+	}
+	for (i=0; i<height; i++) {
+		ol->croprows[i] = ol->inimage[ol->crop_y + i] + offset;
+	}
+	return 0;
+}
+
+struct oil_ring *oil_ring_new(int slots, int slot_rows, int row_len,
+	int offset)
+{
+	int i;
+	struct oil_ring *r;
+
+	r = calloc(1, sizeof(struct oil_ring));
+	if (!r) {
+		return NULL;
+	}
+	r->slots = slots;
+	r->slot_rows = slot_rows;
+	r->buf = malloc((size_t)slots * slot_rows * row_len);
+	r->rows = malloc(slots * slot_rows * sizeof(unsigned char *));
+	r->view = malloc(slots * slot_rows * sizeof(unsigned char *));
+	r->fill = calloc(slots, sizeof(int));
+	if (!r->buf || !r->rows || !r->view || !r->fill) {
+		free(r->buf);
+		free(r->rows);
+		free(r->view);
+		free(r->fill);
+		free(r);
+		return NULL;
+	}
+	for (i=0; i<slots * slot_rows; i++) {
+		r->rows[i] = r->buf + (size_t)i * row_len;
+		r->view[i] = r->rows[i] + offset;
+	}
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	return r;
+}
+
+void oil_ring_free(struct oil_ring *r)
+{
+	if (!r) {
+		return;
+	}
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	free(r->buf);
+	free(r->rows);
+	free(r->view);
+	free(r->fill);
+	free(r);
+}
+
+unsigned char **oil_ring_produce(struct oil_ring *r)
+{
+	unsigned char **rows;
+
+	pthread_mutex_lock(&r->lock);
+	while (r->count == r->slots && !r->closed) {
+		pthread_cond_wait(&r->cond, &r->lock);
+	}
+	rows = r->closed ? NULL : r->rows + r->head * r->slot_rows;
+	pthread_mutex_unlock(&r->lock);
+	return rows;
+}
+
+void oil_ring_publish(struct oil_ring *r, int n)
+{
+	pthread_mutex_lock(&r->lock);
+	r->fill[r->head] = n;
+	r->head = (r->head + 1) % r->slots;
+	r->count++;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+unsigned char **oil_ring_consume(struct oil_ring *r, int *n)
+{
+	unsigned char **rows;
+
+	pthread_mutex_lock(&r->lock);
+	while (r->count == 0 && !r->closed) {
+		pthread_cond_wait(&r->cond, &r->lock);
+	}
+	rows = NULL;
+	if (r->count > 0) {
+		rows = r->view + r->tail * r->slot_rows;
+		*n = r->fill[r->tail];
+	}
+	pthread_mutex_unlock(&r->lock);
+	return rows;
+}
+
+void oil_ring_release(struct oil_ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->tail = (r->tail + 1) % r->slots;
+	r->count--;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+void oil_ring_close(struct oil_ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->closed = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void png_read_rows_dec(struct oil_decoder *dec, unsigned char **rows,
+	int n)
+{
+	png_read_rows(dec->rpng, rows, NULL, n);
+}
+
+static void png_read_image_dec(struct oil_decoder *dec, unsigned char **rows)
+{
+	png_read_image(dec->rpng, rows);
+}
+
+int oil_decoder_libpng(struct oil_decoder *dec, png_structp rpng,
+	png_infop rinfo)
 {
-	int ret, in_width, in_height, buf_len;
+	memset(dec, 0, sizeof(struct oil_decoder));
+	dec->cs = png_cs_to_oil(png_get_color_type(rpng, rinfo));
+	if (dec->cs == OIL_CS_UNKNOWN) {
+		return -1;
+	}
+	dec->rpng = rpng;
+	dec->rinfo = rinfo;
+	dec->width = png_get_image_width(rpng, rinfo);
+	dec->height = png_get_image_height(rpng, rinfo);
+	dec->rowbytes = png_get_rowbytes(rpng, rinfo);
+	dec->interlaced = png_get_interlace_type(rpng, rinfo) ==
+		PNG_INTERLACE_ADAM7;
+	dec->read_rows = png_read_rows_dec;
+	dec->read_image = png_read_image_dec;
+	return 0;
+}
+
+void oil_decoder_free(struct oil_decoder *dec)
+{
+	if (dec->free) {
+		dec->free(dec);
+	}
+}
+
+/**
+ * Check that every alpha value of n RGBA rows is 255.
+ */
+static int rows_opaque(unsigned char **rows, int n, int width)
+{
+	int i, j;
+	unsigned char alpha;
+
+	for (i=0; i<n; i++) {
+		alpha = 0xff;
+		for (j=3; j<width * 4; j+=4) {
+			alpha &= rows[i][j];
+		}
+		if (alpha != 0xff) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int oil_libpng_init_decoder(struct oil_libpng *ol, struct oil_decoder *dec,
+	const struct oil_libpng_crop *crop, int out_width, int out_height,
+	const struct oil_scale_opts *opts, int opaque)
+{
+	int ret, in_width, in_height;
 	enum oil_colorspace cs;
 
-	ol->rpng = rpng;
-	ol->rinfo = rinfo;
+	ol->dec = dec;
 	ol->in_vpos = 0;
 	ol->inbuf = NULL;
 	ol->inimage = NULL;
+	ol->inrows = NULL;
+	ol->batch = 0;
+	ol->block_pos = 0;
+	ol->block_len = 0;
+	ol->croprows = NULL;
+	ol->block = NULL;
+	ol->pipe = NULL;
 
-	cs = png_cs_to_oil(png_get_color_type(rpng, rinfo));
-	if (cs == OIL_CS_UNKNOWN) {
-		return -1;
-	}
+	cs = dec->cs;
+	ol->opaque = opaque && cs == OIL_CS_RGBA;
 
-	in_width = png_get_image_width(rpng, rinfo);
-	in_height = png_get_image_height(rpng, rinfo);
-	ret = oil_scale_init(&ol->os, in_height, out_height, in_width,
-		out_width, cs);
-	if (ret!=0) {
-		free(ol->inbuf);
-		return ret;
+	in_width = dec->width;
+	in_height = ol->full_height = dec->height;
+	ol->crop_x = ol->crop_y = 0;
+	if (crop) {
+		if (crop->x < 0 || crop->y < 0 || crop->width < 1 ||
+			crop->height < 1 || crop->width > in_width - crop->x ||
+			crop->height > in_height - crop->y) {
+			return -1;
+		}
+		ol->crop_x = crop->x;
+		ol->crop_y = crop->y;
+		in_width = crop->width;
+		in_height = crop->height;
 	}
 
-	buf_len = png_get_rowbytes(rpng, rinfo);
-	switch (png_get_interlace_type(rpng, rinfo)) {
-	case PNG_INTERLACE_NONE:
-		ol->inbuf = malloc(buf_len);
-		if (!ol->inbuf) {
-			oil_scale_free(&ol->os);
+	/* the whole image is at hand, no need to assume anything */
+	if (dec->interlaced) {
+		ol->inimage = alloc_full_image_buf(ol->full_height,
+			dec->rowbytes);
+		if (!ol->inimage) {
 			return -2;
 		}
-		break;
-	case PNG_INTERLACE_ADAM7:
-		ol->inimage = alloc_full_image_buf(in_height, buf_len);
-		if (!ol->inimage) {
-			oil_scale_free(&ol->os);
+		dec->read_image(dec, ol->inimage);
+		if (crop_image(ol, in_height) != 0) {
+			free_full_image_buf(ol->inimage, ol->full_height);
 			return -2;
 		}
-		png_read_image(rpng, ol->inimage);
-		break;
+		ol->opaque = ol->opaque && rows_opaque(ol->croprows,
+			in_height, in_width);
+	}
+
+	ret = oil_scale_init_opts(&ol->os, in_height, out_height, in_width,
+		out_width, ol->opaque ? OIL_CS_RGBX : cs, opts);
+	if (ret!=0) {
+		if (ol->inimage) {
+			free_full_image_buf(ol->inimage, ol->full_height);
+			free(ol->croprows);
+		}
+		return ret;
 	}
 
+	if (!ol->inimage && alloc_block(ol, BATCH_ROWS) != 0) {
+		oil_scale_free(&ol->os);
+		return -2;
+	}
+
+	/* interlaced rows have been checked already */
+	ol->opaque = ol->opaque && !ol->inimage;
+	return 0;
+}
+
+int oil_libpng_init_crop(struct oil_libpng *ol, png_structp rpng,
+	png_infop rinfo, const struct oil_libpng_crop *crop, int out_width,
+	int out_height, const struct oil_scale_opts *opts, int opaque)
+{
+	if (oil_decoder_libpng(&ol->png_dec, rpng, rinfo) != 0) {
+		return -1;
+	}
+	return oil_libpng_init_decoder(ol, &ol->png_dec, crop, out_width,
+		out_height, opts, opaque);
+}
+
+int oil_libpng_init(struct oil_libpng *ol, png_structp rpng, png_infop rinfo,
+	int out_width, int out_height)
+{
+	return oil_libpng_init_crop(ol, rpng, rinfo, NULL, out_width,
+		out_height, NULL, 0);
+}
+
+int oil_libpng_init_opts(struct oil_libpng *ol, png_structp rpng,
+	png_infop rinfo, int out_width, int out_height,
+	const struct oil_scale_opts *opts)
+{
+	return oil_libpng_init_crop(ol, rpng, rinfo, NULL, out_width,
+		out_height, opts, 0);
+}
+
+int oil_libpng_init_opaque(struct oil_libpng *ol, png_structp rpng,
+	png_infop rinfo, int out_width, int out_height,
+	const struct oil_scale_opts *opts)
+{
+	return oil_libpng_init_crop(ol, rpng, rinfo, NULL, out_width,
+		out_height, opts, 1);
+}
+
+int oil_libpng_set_threads(struct oil_libpng *ol, int nthreads)
+{
+	if (oil_scale_set_threads(&ol->os, nthreads) != 0) {
+		return -2;
+	}
+	/* a few rows per thread and per wake-up */
+	if (!ol->inbuf || 8 * nthreads <= ol->batch || ol->block_len ||
+		ol->pipe) {
+		return 0;
+	}
+	if (alloc_block(ol, 8 * nthreads) != 0) {
+		oil_scale_set_threads(&ol->os, 1);
+		return -2;
+	}
+	return 0;
+}
+
+/**
+ * Decoder stage of the pipeline: reads the source into the ring until the
+ * last row of the crop window, or until the consumer closes the ring.
+ */
+static void *decoder_main(void *arg)
+{
+	int n, pos, end;
+	unsigned char **rows;
+	struct oil_libpng *ol;
+
+	ol = arg;
+	rows = oil_ring_produce(ol->pipe);
+	for (pos=0; rows && pos<ol->crop_y; pos+=n) {
+		n = ol->crop_y - pos;
+		n = n < ol->batch ? n : ol->batch;
+		ol->dec->read_rows(ol->dec, rows, n);
+	}
+	end = ol->crop_y + ol->os.in_height;
+	for (; rows && pos<end; pos+=n) {
+		n = end - pos;
+		n = n < ol->batch ? n : ol->batch;
+		ol->dec->read_rows(ol->dec, rows, n);
+		oil_ring_publish(ol->pipe, n);
+		if (pos + n < end) {
+			rows = oil_ring_produce(ol->pipe);
+		}
+	}
+	return NULL;
+}
+
+int oil_libpng_set_pipeline(struct oil_libpng *ol, int slots)
+{
+	int offset;
+
+	if (!ol->inbuf || ol->pipe || ol->block_len) {
+		return 0;
+	}
+	offset = ol->crop_x * OIL_CMP(ol->dec->cs);
+	ol->pipe = oil_ring_new(slots, ol->batch, ol->dec->rowbytes, offset);
+	if (!ol->pipe) {
+		return -2;
+	}
+	if (pthread_create(&ol->decoder, NULL, decoder_main, ol) != 0) {
+		oil_ring_free(ol->pipe);
+		ol->pipe = NULL;
+		return -2;
+	}
 	return 0;
 }
 
 void oil_libpng_free(struct oil_libpng *ol)
 {
+	if (ol->pipe) {
+		oil_ring_close(ol->pipe);
+		pthread_join(ol->decoder, NULL);
+		oil_ring_free(ol->pipe);
+	}
 	if (ol->inbuf) {
 		free(ol->inbuf);
 	}
+	free(ol->inrows);
+	free(ol->croprows);
 	if (ol->inimage) {
-		free_full_image_buf(ol->inimage, ol->os.in_height);
+		free_full_image_buf(ol->inimage, ol->full_height);
 	}
 	oil_scale_free(&ol->os);
 }
@@ -116,32 +469,214 @@ static void read_scanline_interlaced(struct oil_libpng *ol)
 {
 	int i;
 
-	for (i=oil_scale_slots(&ol->os); i>0; i--) {
-		oil_scale_in(&ol->os, ol->inimage[ol->in_vpos++]);
+	i = oil_scale_slots(&ol->os);
+	if (i > 0) {
+		oil_scale_in_rows(&ol->os, ol->croprows + ol->in_vpos, i);
+		ol->in_vpos += i;
 	}
 }
 
-static void read_scanline(struct oil_libpng *ol)
+/**
+ * Make the next block of decoded rows current, from the decoder thread if
+ * there is one. Rows above the crop window still have to be decoded, but they
+ * are dropped here before reaching the scaler. Rows below it are never
+ * decoded.
+ */
+static void next_block(struct oil_libpng *ol)
 {
-	int i;
+	int n;
+
+	if (ol->pipe) {
+		if (ol->block) {
+			oil_ring_release(ol->pipe);
+		}
+		ol->block = oil_ring_consume(ol->pipe, &ol->block_len);
+		ol->in_vpos += ol->block_len;
+		ol->block_pos = 0;
+		return;
+	}
+	for (; ol->in_vpos < ol->crop_y; ol->in_vpos += n) {
+		n = ol->crop_y - ol->in_vpos;
+		n = n < ol->batch ? n : ol->batch;
+		ol->dec->read_rows(ol->dec, ol->inrows, n);
+	}
+	n = ol->crop_y + ol->os.in_height - ol->in_vpos;
+	ol->block_len = n < ol->batch ? n : ol->batch;
+	ol->dec->read_rows(ol->dec, ol->inrows, ol->block_len);
+	ol->in_vpos += ol->block_len;
+	ol->block_pos = 0;
+	ol->block = ol->croprows;
+}
+
+static int read_scanline(struct oil_libpng *ol)
+{
+	int i, n;
 
-	for (i=oil_scale_slots(&ol->os); i>0; i--) {
-		png_read_row(ol->rpng, ol->inbuf, NULL);
-		oil_scale_in(&ol->os, ol->inbuf);
+	for (i=oil_scale_slots(&ol->os); i>0; i-=n) {
+		if (ol->block_pos == ol->block_len) {
+			next_block(ol);
+			if (ol->opaque && !rows_opaque(ol->block,
+				ol->block_len, ol->os.in_width)) {
+				return -1;
+			}
+		}
+		n = ol->block_len - ol->block_pos;
+		n = i < n ? i : n;
+		oil_scale_in_rows(&ol->os, ol->block + ol->block_pos, n);
+		ol->block_pos += n;
 	}
+	return 0;
 }
 
-void oil_libpng_read_scanline(struct oil_libpng *ol, unsigned char *outbuf)
+static int read_input(struct oil_libpng *ol)
 {
-	switch (png_get_interlace_type(ol->rpng, ol->rinfo)) {
-	case PNG_INTERLACE_NONE:
-		read_scanline(ol);
-		break;
-	case PNG_INTERLACE_ADAM7:
-		read_scanline_interlaced(ol);
-		break;
+	if (!ol->dec->interlaced) {
+		return read_scanline(ol);
+	}
+	read_scanline_interlaced(ol);
+	return 0;
+}
+
+int oil_libpng_read_scanline(struct oil_libpng *ol, unsigned char *outbuf)
+{
+	if (read_input(ol) != 0) {
+		return -1;
 	}
 	oil_scale_out(&ol->os, outbuf);
+	return 0;
+}
+
+int oil_libpng_read_scanlines(struct oil_libpng *ol, unsigned char **outbufs,
+	int n)
+{
+	int i;
+
+	for (i=0; i<n; ) {
+		if (read_input(ol) != 0) {
+			return -1;
+		}
+		i += oil_scale_out_rows(&ol->os, outbufs + i, n - i);
+	}
+	return 0;
+}
+
+int oil_libpng_multi_init_decoder(struct oil_libpng_multi *olm,
+	struct oil_decoder *dec, const struct oil_libpng_crop *crop, int n,
+	const int *out_widths, const int *out_heights,
+	const struct oil_scale_opts *opts, int opaque)
+{
+	int i, ret, in_width, in_height;
+	enum oil_colorspace cs;
+
+	olm->dec = dec;
+	olm->in_vpos = 0;
+	olm->inbuf = NULL;
+	olm->inimage = NULL;
+
+	cs = dec->cs;
+	olm->opaque = opaque && cs == OIL_CS_RGBA;
+
+	in_width = dec->width;
+	in_height = dec->height;
+	olm->crop_x = olm->crop_y = 0;
+	if (crop) {
+		if (crop->x < 0 || crop->y < 0 || crop->width < 1 ||
+			crop->height < 1 || crop->width > in_width - crop->x ||
+			crop->height > in_height - crop->y) {
+			return -1;
+		}
+		olm->crop_x = crop->x;
+		olm->crop_y = crop->y;
+		in_width = crop->width;
+		in_height = crop->height;
+	}
+	olm->crop_height = in_height;
+
+	/* the whole image is at hand, no need to assume anything */
+	if (dec->interlaced) {
+		olm->inimage = alloc_full_image_buf(dec->height, dec->rowbytes);
+		if (!olm->inimage) {
+			return -2;
+		}
+		dec->read_image(dec, olm->inimage);
+		for (i=0; olm->opaque && i<in_height; i++) {
+			olm->opaque = rows_opaque(olm->inimage + olm->crop_y + i,
+				1, in_width);
+		}
+		olm->in_vpos = olm->crop_y;
+	}
+
+	ret = oil_multi_scale_init(&olm->ms, n, in_height, in_width,
+		out_heights, out_widths, olm->opaque ? OIL_CS_RGBX : cs, opts);
+	if (ret!=0) {
+		if (olm->inimage) {
+			free_full_image_buf(olm->inimage, dec->height);
+		}
+		return ret;
+	}
+
+	if (!dec->interlaced) {
+		olm->inbuf = malloc(dec->rowbytes);
+		if (!olm->inbuf) {
+			oil_multi_scale_free(&olm->ms);
+			return -2;
+		}
+	}
+
+	/* interlaced rows have been checked already */
+	olm->opaque = olm->opaque && !olm->inimage;
+	return 0;
+}
+
+int oil_libpng_multi_init(struct oil_libpng_multi *olm, png_structp rpng,
+	png_infop rinfo, int n, const int *out_widths, const int *out_heights,
+	const struct oil_scale_opts *opts)
+{
+	if (oil_decoder_libpng(&olm->png_dec, rpng, rinfo) != 0) {
+		return -1;
+	}
+	return oil_libpng_multi_init_decoder(olm, &olm->png_dec, NULL, n,
+		out_widths, out_heights, opts, 0);
+}
+
+void oil_libpng_multi_free(struct oil_libpng_multi *olm)
+{
+	free(olm->inbuf);
+	if (olm->inimage) {
+		free_full_image_buf(olm->inimage, olm->dec->height);
+	}
+	oil_multi_scale_free(&olm->ms);
+}
+
+int oil_libpng_multi_read_scanline(struct oil_libpng_multi *olm,
+	unsigned char **outbuf)
+{
+	int i, offset;
+	unsigned char *row;
+
+	offset = olm->crop_x * OIL_CMP(olm->dec->cs);
+	while ((i = oil_multi_scale_out(&olm->ms, outbuf)) < 0) {
+		if (olm->in_vpos == olm->crop_y + olm->crop_height) {
+			return -1;
+		}
+		if (olm->inimage) {
+			row = olm->inimage[olm->in_vpos] + offset;
+		} else {
+			// rows above the crop window are decoded and dropped
+			for (; olm->in_vpos < olm->crop_y; olm->in_vpos++) {
+				olm->dec->read_rows(olm->dec, &olm->inbuf, 1);
+			}
+			olm->dec->read_rows(olm->dec, &olm->inbuf, 1);
+			row = olm->inbuf + offset;
+			if (olm->opaque && !rows_opaque(&row, 1,
+				olm->ms.os[0].in_width)) {
+				return -2;
+			}
+		}
+		oil_multi_scale_in(&olm->ms, row);
+		olm->in_vpos++;
+	}
+	return i;
 }
 
 enum oil_colorspace png_cs_to_oil(png_byte cs)
@@ -23,16 +23,145 @@
 #define OIL_LIBPNG_H
 
 #include <stdio.h>
+#include <pthread.h>
 #include <png.h>
 #include "oil_resample.h"
 
-struct oil_libpng {
-	struct oil_scale os;
+/**
+ * Bounded queue of row blocks between one producer and one consumer thread.
+ * The producer fills a slot of slot_rows rows, then publishes it; the consumer
+ * reads published slots in order and releases them. Slots are reused, so rows
+ * are never copied and nothing is allocated past oil_ring_new().
+ */
+struct oil_ring {
+	int slots; // number of blocks.
+	int slot_rows; // rows per block.
+	unsigned char *buf;
+	unsigned char **rows; // rows of every slot, as filled by the producer.
+	unsigned char **view; // same rows from the offset, as consumed.
+	int *fill; // rows published in each slot.
+	int head; // next slot to fill.
+	int tail; // next slot to consume.
+	int count; // slots published and not yet released.
+	int closed; // no more blocks will be produced or consumed.
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/**
+ * Allocate a ring of slots blocks of slot_rows rows of row_len bytes. The
+ * consumer sees rows starting offset bytes in.
+ *
+ * Returns NULL if unable to allocate memory.
+ */
+struct oil_ring *oil_ring_new(int slots, int slot_rows, int row_len,
+	int offset);
+
+void oil_ring_free(struct oil_ring *r);
+
+/**
+ * Wait for a free slot and return its rows, or NULL once the ring is closed.
+ */
+unsigned char **oil_ring_produce(struct oil_ring *r);
+
+/**
+ * Hand the first n rows of the slot from oil_ring_produce() to the consumer.
+ */
+void oil_ring_publish(struct oil_ring *r, int n);
+
+/**
+ * Wait for a published slot and return its rows, with the number of rows in
+ * n. Returns NULL once the ring is closed and empty.
+ */
+unsigned char **oil_ring_consume(struct oil_ring *r, int *n);
+
+/**
+ * Give the slot from oil_ring_consume() back to the producer.
+ */
+void oil_ring_release(struct oil_ring *r);
+
+/**
+ * Stop the ring from either end: the producer's next oil_ring_produce() and,
+ * once the published slots are consumed, the consumer's next
+ * oil_ring_consume() return NULL.
+ */
+void oil_ring_close(struct oil_ring *r);
+
+/**
+ * Source of decoded rows: 8 bits per sample, palettes and tRNS expanded to
+ * RGB(A), ready for the scaler. Backed by libpng, or by another decoder that
+ * delivers the very same rows.
+ */
+struct oil_decoder {
+	int width;
+	int height;
+	enum oil_colorspace cs;
+	int rowbytes;
+	int interlaced; // rows only come from read_image().
+	int error; // set once decoding failed, rows are zeroed from then on.
+
+	/**
+	 * Decode the next n rows of a non-interlaced source.
+	 */
+	void (*read_rows)(struct oil_decoder *dec, unsigned char **rows, int n);
+
+	/**
+	 * Decode the whole source into height rows.
+	 */
+	void (*read_image)(struct oil_decoder *dec, unsigned char **rows);
+
+	/**
+	 * Release what the backend allocated, NULL if it owns nothing.
+	 */
+	void (*free)(struct oil_decoder *dec);
+
 	png_structp rpng;
 	png_infop rinfo;
+	void *ctx; // other backends.
+};
+
+/**
+ * Decode through a libpng read struct, with its transformations already set
+ * up and png_read_update_info() done: expanded to 8 bits per sample at least
+ * and with 16-bit samples stripped. The read struct remains the caller's.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the color type is not supported.
+ */
+int oil_decoder_libpng(struct oil_decoder *dec, png_structp rpng,
+	png_infop rinfo);
+
+void oil_decoder_free(struct oil_decoder *dec);
+
+struct oil_libpng {
+	struct oil_scale os;
+	struct oil_decoder *dec;
+	struct oil_decoder png_dec; // wraps the read struct given to init.
 	int in_vpos;
 	unsigned char *inbuf;
 	unsigned char **inimage;
+	unsigned char **inrows; // rows of inbuf handed to oil_scale_in_rows().
+	int batch; // number of rows read from libpng at once.
+	int block_pos; // next row of inbuf to hand to the scaler.
+	int block_len; // number of rows of inbuf holding read-ahead input.
+	int opaque; // check that rows read from now on have no alpha below 255.
+	int crop_x; // first source column handed to the scaler.
+	int crop_y; // first source row handed to the scaler.
+	int full_height; // source height, rows of inimage.
+	unsigned char **croprows; // input rows from crop_x, as scaled.
+	unsigned char **block; // rows of the block being scaled, from crop_x.
+	struct oil_ring *pipe; // blocks from the decoder thread, if any.
+	pthread_t decoder;
+};
+
+/**
+ * Window of the source image to scale.
+ */
+struct oil_libpng_crop {
+	int x;
+	int y;
+	int width;
+	int height;
 };
 
 /**
@@ -49,9 +178,148 @@ struct oil_libpng {
 int oil_libpng_init(struct oil_libpng *ol, png_structp rpng, png_infop rinfo,
 	int out_width, int out_height);
 
+/**
+ * Same as oil_libpng_init(), with settings passed on to oil_scale_init_opts().
+ */
+int oil_libpng_init_opts(struct oil_libpng *ol, png_structp rpng,
+	png_infop rinfo, int out_width, int out_height,
+	const struct oil_scale_opts *opts);
+
+/**
+ * Same as oil_libpng_init_opts(), but RGBA sources are assumed to be fully
+ * opaque, as most exported RGBA images are, and scaled as RGBX. Output rows
+ * are then RGBX: use png_set_filler() on the write struct to strip the pad.
+ *
+ * Sources that are only read row by row are checked as they come in, and
+ * reading fails once an alpha below 255 turns up. Start over on a new read
+ * struct with oil_libpng_init_opts() in that case.
+ */
+int oil_libpng_init_opaque(struct oil_libpng *ol, png_structp rpng,
+	png_infop rinfo, int out_width, int out_height,
+	const struct oil_scale_opts *opts);
+
+/**
+ * Same as oil_libpng_init_opaque() if opaque is set and as
+ * oil_libpng_init_opts() otherwise, but only the crop window of the source is
+ * scaled, to out_width x out_height. Rows above the window are decoded and
+ * dropped, rows below it are never decoded. A NULL crop takes the whole
+ * source.
+ *
+ * Returns -1 if the window does not fit in the source.
+ */
+int oil_libpng_init_crop(struct oil_libpng *ol, png_structp rpng,
+	png_infop rinfo, const struct oil_libpng_crop *crop, int out_width,
+	int out_height, const struct oil_scale_opts *opts, int opaque);
+
+/**
+ * Same as oil_libpng_init_crop(), reading from any decoder. The decoder must
+ * outlive the struct.
+ */
+int oil_libpng_init_decoder(struct oil_libpng *ol, struct oil_decoder *dec,
+	const struct oil_libpng_crop *crop, int out_width, int out_height,
+	const struct oil_scale_opts *opts, int opaque);
+
 void oil_libpng_free(struct oil_libpng *ol);
 
-void oil_libpng_read_scanline(struct oil_libpng *ol, unsigned char *outbuf);
+/**
+ * Let the scaler use up to nthreads threads. Input rows are then read from
+ * libpng in batches so that they can be scaled in parallel.
+ *
+ * Returns 0 on success.
+ * Returns -2 if unable to allocate memory or to start threads, the struct
+ * is then still usable sequentially.
+ */
+int oil_libpng_set_threads(struct oil_libpng *ol, int nthreads);
+
+/**
+ * Decode the source on a thread of its own, slots blocks of rows ahead of the
+ * scaler. The decoder then belongs to that thread until oil_libpng_free().
+ * Call after oil_libpng_set_threads() and before reading any scanline.
+ * Interlaced sources are decoded during initialization already, and are left
+ * alone.
+ *
+ * Returns 0 on success.
+ * Returns -2 if unable to allocate memory or to start the thread, the struct
+ * is then still usable without it.
+ */
+int oil_libpng_set_pipeline(struct oil_libpng *ol, int slots);
+
+/**
+ * Produce the next output scanline.
+ *
+ * Returns 0 on success.
+ * Returns -1 if a source assumed to be opaque is not.
+ */
+int oil_libpng_read_scanline(struct oil_libpng *ol, unsigned char *outbuf);
+
+/**
+ * Produce the next n output scanlines, at most what is left of the image.
+ *
+ * Returns 0 on success.
+ * Returns -1 if a source assumed to be opaque is not.
+ */
+int oil_libpng_read_scanlines(struct oil_libpng *ol, unsigned char **outbufs,
+	int n);
+
+/**
+ * One libpng source decoded once and scaled to several sizes.
+ */
+struct oil_libpng_multi {
+	struct oil_multi_scale ms;
+	struct oil_decoder *dec;
+	struct oil_decoder png_dec;
+	int in_vpos;
+	unsigned char *inbuf;
+	unsigned char **inimage;
+	int opaque; // check that rows read from now on have no alpha below 255.
+	int crop_x; // first source column handed to the scalers.
+	int crop_y; // first source row handed to the scalers.
+	int crop_height; // number of source rows handed to the scalers.
+};
+
+/**
+ * Initialize an oil_libpng_multi struct.
+ * @olm: Pointer to the struct to be initialized.
+ * @n: Number of outputs.
+ * @out_widths: Desired widths, in pixels, of the n output images.
+ * @out_heights: Desired heights, in pixels, of the n output images.
+ * @opts: Settings for each of the n outputs, or NULL for the defaults.
+ *
+ * Returns 0 on success.
+ * Returns -1 if an argument is bad.
+ * Returns -2 if unable to allocate memory.
+ */
+int oil_libpng_multi_init(struct oil_libpng_multi *olm, png_structp rpng,
+	png_infop rinfo, int n, const int *out_widths, const int *out_heights,
+	const struct oil_scale_opts *opts);
+
+/**
+ * Same as oil_libpng_multi_init(), reading from any decoder, and scaling only
+ * the crop window of the source as oil_libpng_init_decoder() does. With
+ * opaque set, RGBA sources are assumed to be fully opaque and scaled as RGBX,
+ * as with oil_libpng_init_opaque().
+ *
+ * Returns -1 if the window does not fit in the source.
+ */
+int oil_libpng_multi_init_decoder(struct oil_libpng_multi *olm,
+	struct oil_decoder *dec, const struct oil_libpng_crop *crop, int n,
+	const int *out_widths, const int *out_heights,
+	const struct oil_scale_opts *opts, int opaque);
+
+void oil_libpng_multi_free(struct oil_libpng_multi *olm);
+
+/**
+ * Produce the next output scanline of any of the outputs, decoding input as
+ * needed. Output scanlines of each output come in order.
+ * @outbuf: Set to the scanline, valid until the next call.
+ *
+ * Returns the index of the output the scanline belongs to.
+ * Returns -1 once every output is complete.
+ * Returns -2 if an opaque source turned out to have some transparency. Start
+ * over on a new decoder with opaque unset in that case.
+ */
+int oil_libpng_multi_read_scanline(struct oil_libpng_multi *olm,
+	unsigned char **outbuf);
 
 enum oil_colorspace png_cs_to_oil(png_byte cs);
 
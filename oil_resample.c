@@ -20,7 +20,10 @@
  */
 
 #include "oil_resample.h"
+#include "oil_tables.h"
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <string.h>
@@ -92,20 +95,22 @@ static int split_map(int dim_in, int dim_out, int pos, float *rest)
 }
 
 /**
- * Given input and output dimension, calculate the total number of taps that
- * will be needed to calculate an output sample.
- *
- * When we reduce an image by a factor of two, we need to scale our resampling
- * function by two as well in order to avoid aliasing.
+ * Box filter, nearest neighbour when upscaling.
  */
-static int calc_taps(int dim_in, int dim_out)
+static float box(float x)
 {
-	int tmp;
-	if (dim_out > dim_in) {
-		return TAPS;
+	if (x < 0.5f) {
+		return 1;
 	}
-	tmp = TAPS * dim_in / dim_out;
-	return tmp - (tmp & 1);
+	return x == 0.5f ? 0.5f : 0;
+}
+
+/**
+ * Triangle filter, bilinear interpolation when upscaling.
+ */
+static float triangle(float x)
+{
+	return x < 1 ? 1 - x : 0;
 }
 
 /**
@@ -120,23 +125,80 @@ static float catrom(float x)
 }
 
 /**
- * Given an offset tx, calculate taps coefficients.
+ * Normalized sinc function.
+ */
+static float sinc(float x)
+{
+	if (x == 0) {
+		return 1;
+	}
+	x *= M_PI;
+	return sinf(x) / x;
+}
+
+/**
+ * Lanczos filter with 2 lobes.
+ */
+static float lanczos2(float x)
+{
+	return x < 2 ? sinc(x) * sinc(x / 2) : 0;
+}
+
+/**
+ * Resampling kernels. The coefficient tables hold 4 coefficients per sample,
+ * which limits the support of a kernel to 2 samples on either side.
+ */
+static const struct {
+	float (*fn)(float);
+	int taps; // base taps: twice the support, rounded up to an even number.
+} filters[] = {
+	[OIL_FILTER_CATROM] = { catrom, TAPS },
+	[OIL_FILTER_BOX] = { box, 2 },
+	[OIL_FILTER_TRIANGLE] = { triangle, 2 },
+	[OIL_FILTER_LANCZOS2] = { lanczos2, TAPS },
+};
+
+/**
+ * Given input and output dimension, calculate the total number of taps that
+ * will be needed to calculate an output sample.
+ *
+ * When we reduce an image by a factor of two, we need to scale our resampling
+ * function by two as well in order to avoid aliasing.
+ */
+static int calc_taps(int dim_in, int dim_out, enum oil_filter filter)
+{
+	int tmp;
+	if (dim_out > dim_in) {
+		return TAPS;
+	}
+	tmp = filters[filter].taps * dim_in / dim_out;
+	return tmp - (tmp & 1);
+}
+
+/**
+ * Given an offset tx, calculate taps coefficients. The kernel is stretched by
+ * tap_mult when downscaling.
  */
-static void calc_coeffs(float *coeffs, float tx, int taps, int ltrim, int rtrim)
+static void calc_coeffs(float *coeffs, float tx, int taps, float tap_mult,
+	int ltrim, int rtrim, enum oil_filter filter)
 {
 	int i;
-	float tmp, tap_mult, fudge;
+	float tmp, fudge;
+	float (*fn)(float);
 
-	tap_mult = (float)taps / TAPS;
+	fn = filters[filter].fn;
 	tx = 1 - tx - taps / 2 + ltrim;
 	fudge = 0.0f;
 
 	for (i=ltrim; i<taps-rtrim; i++) {
-		tmp = catrom(fabsf(tx) / tap_mult) / tap_mult;
+		tmp = fn(fabsf(tx) / tap_mult) / tap_mult;
 		fudge += tmp;
 		coeffs[i] = tmp;
 		tx += 1;
 	}
+	if (fudge == 0) {
+		return;
+	}
 	fudge = 1 / fudge;
 	for (i=ltrim; i<taps-rtrim; i++) {
 		coeffs[i] *= fudge;
@@ -144,45 +206,11 @@ static void calc_coeffs(float *coeffs, float tx, int taps, int ltrim, int rtrim)
 }
 
 /**
- * Pre-calculated table of linear to srgb mappings. Initialized via build_l2s().
- *
- * catmull-rom interpolation can produce values from -17/64 to 81/64.
- *
- * The total allocated space will be split into three parts:
- *   * 17/98 of padding below zero
- *   * 64/98 of mapping
- *   * 17/98 of padding above one
+ * Pre-calculated table of linear to srgb mappings, with padding on both sides
+ * for the overshoot of catmull-rom interpolation. Generated by oil_gentables.
  */
-#define L2S_ALL_LEN 32768
-static unsigned char l2s_map_all[L2S_ALL_LEN];
-static int l2s_len;
-static unsigned char *l2s_map;
-
-static void build_l2s(void)
-{
-	int i, padding;
-	double srgb_f, tmp, val;
-
-	padding = L2S_ALL_LEN * 17 / 98;
-	l2s_len = L2S_ALL_LEN - 2 * padding;
-	l2s_map = l2s_map_all + padding;
-
-	for (i=0; i<l2s_len; i++) {
-		srgb_f = (i + 0.5)/(l2s_len - 1);
-		if (srgb_f <= 0.00313) {
-			val = srgb_f * 12.92;
-		} else {
-			tmp = pow(srgb_f, 1/2.4);
-			val = 1.055 * tmp - 0.055;
-		}
-
-		l2s_map[i] = round(val * 255);
-	}
-
-	for (i=0; i<padding; i++) {
-		l2s_map[l2s_len + i] = 255;
-	}
-}
+#define l2s_map (l2s_map_all + L2S_PADDING)
+#define l2s_len L2S_LEN
 
 /**
  * Maps the given linear RGB float to sRGB integer.
@@ -196,7 +224,7 @@ static unsigned char linear_sample_to_srgb(float in)
  * Takes a sample value, an array of 4 coefficients & 4 accumulators, and
  * adds the product of sample * coeffs[n] to each accumulator.
  */
-static void add_sample_to_sum_f(float sample, float *coeffs, float *sum)
+static void add_sample_to_sum_f(float sample, const float *coeffs, float *sum)
 {
 	int i;
 	for (i=0; i<4; i++) {
@@ -225,14 +253,14 @@ static void shift_left_f(float *f)
 	push_f(f, 0.0f);
 }
 
-static void reduce_strip(float *in, int strip_height, int len, float *coeffs,
-	float *sums, int n)
+static void reduce_strip(float *in, int strip_height, int stride,
+	const float *coeffs, float *sums, int n)
 {
 	int i, j;
 
 	for (i=0; i<strip_height; i++) {
 		for (j=0; j<n; j++) {
-			add_sample_to_sum_f(in[i * len + j], coeffs + i * 4, sums + j * 4);
+			add_sample_to_sum_f(in[i * stride + j], coeffs + i * 4, sums + j * 4);
 		}
 	}
 }
@@ -240,13 +268,13 @@ static void reduce_strip(float *in, int strip_height, int len, float *coeffs,
 /**
  * Resizes a strip of RGBX scanlines to a single scanline.
  */
-static void yscale_down_rgbx(float *in, int strip_height, int len,
-	unsigned char *out, float *coeffs, float *sums)
+static void yscale_down_rgbx(float *in, int strip_height, int stride,
+	int len, unsigned char *out, const float *coeffs, float *sums)
 {
 	int i, j;
 
 	for (i=0; i<len; i+=4) {
-		reduce_strip(in, strip_height, len, coeffs, sums, 3);
+		reduce_strip(in, strip_height, stride, coeffs, sums, 3);
 		for (j=0; j<3; j++) {
 			out[j] = linear_sample_to_srgb(sums[j * 4]);
 			shift_left_f(sums + j * 4);
@@ -261,13 +289,13 @@ static void yscale_down_rgbx(float *in, int strip_height, int len,
 /**
  * Resizes a strip of RGB scanlines to a single scanline.
  */
-static void yscale_down_rgb(float *in, int strip_height, int len,
-	unsigned char *out, float *coeffs, float *sums)
+static void yscale_down_rgb(float *in, int strip_height, int stride,
+	int len, unsigned char *out, const float *coeffs, float *sums)
 {
 	int i, j;
 
 	for (i=0; i<len; i+=3) {
-		reduce_strip(in, strip_height, len, coeffs, sums, 3);
+		reduce_strip(in, strip_height, stride, coeffs, sums, 3);
 		for (j=0; j<3; j++) {
 			out[j] = linear_sample_to_srgb(sums[j * 4]);
 			shift_left_f(sums + j * 4);
@@ -281,13 +309,13 @@ static void yscale_down_rgb(float *in, int strip_height, int len,
 /**
  * Resizes a strip of greyscale scanlines to a single scanline.
  */
-static void yscale_down_g(float *in, int strip_height, int len,
-	unsigned char *out, float *coeffs, float *sums)
+static void yscale_down_g(float *in, int strip_height, int stride,
+	int len, unsigned char *out, const float *coeffs, float *sums)
 {
 	int i;
 
 	for (i=0; i<len; i++) {
-		reduce_strip(in + i, strip_height, len, coeffs, sums, 1);
+		reduce_strip(in + i, strip_height, stride, coeffs, sums, 1);
 		out[i] = clamp8(sums[0]);
 		shift_left_f(sums);
 		sums += 4;
@@ -297,14 +325,14 @@ static void yscale_down_g(float *in, int strip_height, int len,
 /**
  * Resizes a strip of greyscale-alpha scanlines to a single scanline.
  */
-static void yscale_down_ga(float *in, int strip_height, int len,
-	unsigned char *out, float *coeffs, float *sums)
+static void yscale_down_ga(float *in, int strip_height, int stride,
+	int len, unsigned char *out, const float *coeffs, float *sums)
 {
 	int i;
 	float alpha;
 
 	for (i=0; i<len; i+=2) {
-		reduce_strip(in, strip_height, len, coeffs, sums, 2);
+		reduce_strip(in, strip_height, stride, coeffs, sums, 2);
 		alpha = clampf(sums[4]);
 		if (alpha != 0) {
 			sums[0] /= alpha;
@@ -322,14 +350,14 @@ static void yscale_down_ga(float *in, int strip_height, int len,
 /**
  * Resizes a strip of RGB-alpha scanlines to a single scanline.
  */
-static void yscale_down_rgba(float *in, int strip_height, int len,
-	unsigned char *out, float *coeffs, float *sums)
+static void yscale_down_rgba(float *in, int strip_height, int stride,
+	int len, unsigned char *out, const float *coeffs, float *sums)
 {
 	int i, j;
 	float alpha;
 
 	for (i=0; i<len; i+=4) {
-		reduce_strip(in, strip_height, len, coeffs, sums, 4);
+		reduce_strip(in, strip_height, stride, coeffs, sums, 4);
 		alpha = clampf(sums[12]);
 		if (alpha != 0) {
 			for (j=0; j<3; j++) {
@@ -348,36 +376,72 @@ static void yscale_down_rgba(float *in, int strip_height, int len,
 	}
 }
 
+/**
+ * Resizes a strip of RGB-alpha scanlines to a single scanline, in gamma space.
+ */
+static void yscale_down_rgba_nogamma(float *in, int strip_height, int stride,
+	int len, unsigned char *out, const float *coeffs, float *sums)
+{
+	int i, j;
+	float alpha;
+
+	for (i=0; i<len; i+=4) {
+		reduce_strip(in, strip_height, stride, coeffs, sums, 4);
+		alpha = clampf(sums[12]);
+		if (alpha != 0) {
+			for (j=0; j<3; j++) {
+				sums[j * 4] /= alpha;
+			}
+		}
+		for (j=0; j<3; j++) {
+			out[j] = clamp8(sums[j * 4]);
+			shift_left_f(sums + j * 4);
+		}
+		out[3] = f2i(alpha * 255.0f);
+		shift_left_f(sums + 12);
+		sums += 16;
+		out += 4;
+		in += 4;
+	}
+}
+
 /**
  * Downscale a strip of scanlines. Branches to the correct interpolator using
  * the given colorspace.
  */
-static void yscale_down(float *in, int strip_height, int len,
-	unsigned char *out, float *coeffs, float *sums, enum oil_colorspace cs)
+static void yscale_down(float *in, int strip_height, int stride, int len,
+	unsigned char *out, const float *coeffs, float *sums,
+	enum oil_colorspace cs)
 {
 	switch(cs) {
 	case OIL_CS_G:
 	case OIL_CS_CMYK:
-		yscale_down_g(in, strip_height, len, out, coeffs, sums);
+	case OIL_CS_RGB_NOGAMMA:
+	case OIL_CS_RGBX_NOGAMMA:
+		yscale_down_g(in, strip_height, stride, len, out, coeffs, sums);
 		break;
 	case OIL_CS_GA:
-		yscale_down_ga(in, strip_height, len, out, coeffs, sums);
+		yscale_down_ga(in, strip_height, stride, len, out, coeffs, sums);
 		break;
 	case OIL_CS_RGB:
-		yscale_down_rgb(in, strip_height, len, out, coeffs, sums);
+		yscale_down_rgb(in, strip_height, stride, len, out, coeffs, sums);
 		break;
 	case OIL_CS_RGBX:
-		yscale_down_rgbx(in, strip_height, len, out, coeffs, sums);
+		yscale_down_rgbx(in, strip_height, stride, len, out, coeffs, sums);
 		break;
 	case OIL_CS_RGBA:
-		yscale_down_rgba(in, strip_height, len, out, coeffs, sums);
+		yscale_down_rgba(in, strip_height, stride, len, out, coeffs, sums);
+		break;
+	case OIL_CS_RGBA_NOGAMMA:
+		yscale_down_rgba_nogamma(in, strip_height, stride, len, out,
+			coeffs, sums);
 		break;
 	case OIL_CS_UNKNOWN:
 		break;
 	}
 }
 
-static void yscale_up_g_cmyk(float **in, int len, float *coeffs,
+static void yscale_up_g_cmyk(float **in, int len, const float *coeffs,
 	unsigned char *out)
 {
 	int i;
@@ -392,7 +456,7 @@ static void yscale_up_g_cmyk(float **in, int len, float *coeffs,
 	}
 }
 
-static void yscale_up_ga(float **in, int len, float *coeffs,
+static void yscale_up_ga(float **in, int len, const float *coeffs,
 	unsigned char *out)
 {
 	int i, j;
@@ -414,7 +478,7 @@ static void yscale_up_ga(float **in, int len, float *coeffs,
 	}
 }
 
-static void yscale_up_rgb(float **in, int len, float *coeffs,
+static void yscale_up_rgb(float **in, int len, const float *coeffs,
 	unsigned char *out)
 {
 	int i;
@@ -429,7 +493,7 @@ static void yscale_up_rgb(float **in, int len, float *coeffs,
 	}
 }
 
-static void yscale_up_rgbx(float **in, int len, float coeffs[4],
+static void yscale_up_rgbx(float **in, int len, const float coeffs[4],
 	unsigned char *out)
 {
 	int i, j;
@@ -447,7 +511,7 @@ static void yscale_up_rgbx(float **in, int len, float coeffs[4],
 	}
 }
 
-static void yscale_up_rgba(float **in, int len, float *coeffs,
+static void yscale_up_rgba(float **in, int len, const float *coeffs,
 	unsigned char *out)
 {
 	int i, j;
@@ -472,16 +536,42 @@ static void yscale_up_rgba(float **in, int len, float *coeffs,
 	}
 }
 
+static void yscale_up_rgba_nogamma(float **in, int len, const float *coeffs,
+	unsigned char *out)
+{
+	int i, j;
+	float alpha, sums[4];
+
+	for (i=0; i<len; i+=4) {
+		for (j=0; j<4; j++) {
+			sums[j] = coeffs[0] * in[0][i + j] +
+				coeffs[1] * in[1][i + j] +
+				coeffs[2] * in[2][i + j] +
+				coeffs[3] * in[3][i + j];
+		}
+		alpha = clampf(sums[3]);
+		for (j=0; j<3; j++) {
+			if (alpha != 0 && alpha != 1.0f) {
+				sums[j] /= alpha;
+			}
+			out[i + j] = clamp8(sums[j]);
+		}
+		out[i + 3] = f2i(alpha * 255.0f);
+	}
+}
+
 /**
  * Upscale a strip of scanlines. Branches to the correct interpolator using
  * the given colorspace.
  */
-static void yscale_up(float **in, int len, float *coeffs, unsigned char *out,
+static void yscale_up(float **in, int len, const float *coeffs, unsigned char *out,
 	enum oil_colorspace cs)
 {
 	switch(cs) {
 	case OIL_CS_G:
 	case OIL_CS_CMYK:
+	case OIL_CS_RGB_NOGAMMA:
+	case OIL_CS_RGBX_NOGAMMA:
 		yscale_up_g_cmyk(in, len, coeffs, out);
 		break;
 	case OIL_CS_GA:
@@ -496,6 +586,9 @@ static void yscale_up(float **in, int len, float *coeffs, unsigned char *out,
 	case OIL_CS_RGBA:
 		yscale_up_rgba(in, len, coeffs, out);
 		break;
+	case OIL_CS_RGBA_NOGAMMA:
+		yscale_up_rgba_nogamma(in, len, coeffs, out);
+		break;
 	case OIL_CS_UNKNOWN:
 		break;
 	}
@@ -503,42 +596,10 @@ static void yscale_up(float **in, int len, float *coeffs, unsigned char *out,
 
 /* horizontal scaling */
 
-/**
- * Holds pre-calculated mapping of sRGB chars to linear RGB floating point
- * values.
- */
-static float s2l_map[256];
-
-/**
- * Populates s2l_map.
+/*
+ * s2l_map (sRGB chars to linear RGB floats) and i2f_map (chars to floats) are
+ * pre-calculated in oil_tables.h.
  */
-static void build_s2l(void)
-{
-	int input;
-	double in_f, tmp, val;
-
-	for (input=0; input<=255; input++) {
-		in_f = input / 255.0;
-		if (in_f <= 0.040448236277) {
-			val = in_f / 12.92;
-		} else {
-			tmp = ((in_f + 0.055)/1.055);
-			val = pow(tmp, 2.4);
-		}
-		s2l_map[input] = val;
-	}
-}
-
-static float i2f_map[256];
-
-static void build_i2f(void)
-{
-	int i;
-
-	for (i=0; i<=255; i++) {
-		i2f_map[i] = i / 255.0f;
-	}
-}
 
 /**
  * Given input & output dimensions, populate a buffer of coefficients and
@@ -552,13 +613,14 @@ static void build_i2f(void)
  * samples to process before the next output sample is finished.
  */
 static void xscale_calc_coeffs(int in_width, int out_width, float *coeff_buf,
-	int *border_buf, float *tmp_coeffs)
+	int *border_buf, float *tmp_coeffs, enum oil_filter filter)
 {
 	int smp_i, i, j, taps, offset, pos, ltrim, rtrim, smp_end, smp_start,
 		ends[4];
-	float tx;
+	float tx, tap_mult;
 
-	taps = calc_taps(in_width, out_width);
+	taps = calc_taps(in_width, out_width, filter);
+	tap_mult = (float)taps / filters[filter].taps;
 	for (i=0; i<4; i++) {
 		ends[i] = -1;
 	}
@@ -579,7 +641,8 @@ static void xscale_calc_coeffs(int in_width, int out_width, float *coeff_buf,
 			ltrim = -1 * smp_start;
 		}
 		rtrim = smp_start + (taps - 1) - smp_end;
-		calc_coeffs(tmp_coeffs, tx, taps, ltrim, rtrim);
+		calc_coeffs(tmp_coeffs, tx, taps, tap_mult, ltrim, rtrim,
+			filter);
 
 		for (j=ltrim; j<taps - rtrim; j++) {
 			pos = smp_start + j;
@@ -611,7 +674,7 @@ static void xscale_calc_coeffs(int in_width, int out_width, float *coeff_buf,
  * input samples, and multiply them with each output sample's coefficients.
  */
 static void scale_up_coeffs(int in_width, int out_width, float *coeff_buf,
-	int *border_buf)
+	int *border_buf, enum oil_filter filter)
 {
 	int i, smp_i, start, end, ltrim, rtrim, safe_end, max_pos;
 	float tx;
@@ -639,7 +702,7 @@ static void scale_up_coeffs(int in_width, int out_width, float *coeff_buf,
 
 		// we offset coeff_buf by rtrim because the interpolator won't
 		// be pushing any more samples into its sample buffer.
-		calc_coeffs(coeff_buf + rtrim, tx, 4, ltrim, rtrim);
+		calc_coeffs(coeff_buf + rtrim, tx, 4, 1, ltrim, rtrim, filter);
 
 		coeff_buf += 4;
 	}
@@ -659,7 +722,7 @@ static void dump_out(float *out, float sum[][4], int n)
 }
 
 static void xscale_down_rgbx(unsigned char *in, float *out,
-	int out_width, float *coeff_buf, int *border_buf)
+	int out_width, const float *coeff_buf, const int *border_buf)
 {
 	int i, j, k;
 	float sum[3][4] = {{ 0.0f }};
@@ -678,7 +741,7 @@ static void xscale_down_rgbx(unsigned char *in, float *out,
 }
 
 static void xscale_down_rgb(unsigned char *in, float *out,
-	int out_width, float *coeff_buf, int *border_buf)
+	int out_width, const float *coeff_buf, const int *border_buf)
 {
 	int i, j, k;
 	float sum[3][4] = {{ 0.0f }};
@@ -697,7 +760,7 @@ static void xscale_down_rgb(unsigned char *in, float *out,
 }
 
 static void xscale_down_g(unsigned char *in, float *out,
-	int out_width, float *coeff_buf, int *border_buf)
+	int out_width, const float *coeff_buf, const int *border_buf)
 {
 	int i, j;
 	float sum[4] = { 0.0f };
@@ -715,7 +778,7 @@ static void xscale_down_g(unsigned char *in, float *out,
 }
 
 static void xscale_down_cmyk(unsigned char *in, float *out,
-	int out_width, float *coeff_buf, int *border_buf)
+	int out_width, const float *coeff_buf, const int *border_buf)
 {
 	int i, j, k;
 	float sum[4][4] = {{ 0.0f }};
@@ -734,7 +797,7 @@ static void xscale_down_cmyk(unsigned char *in, float *out,
 }
 
 static void xscale_down_rgba(unsigned char *in, float *out,
-	int out_width, float *coeff_buf, int *border_buf)
+	int out_width, const float *coeff_buf, const int *border_buf)
 {
 	int i, j, k;
 	float alpha, sum[4][4] = {{ 0.0f }};
@@ -755,7 +818,7 @@ static void xscale_down_rgba(unsigned char *in, float *out,
 }
 
 static void xscale_down_ga(unsigned char *in, float *out,
-	int out_width, float *coeff_buf, int *border_buf)
+	int out_width, const float *coeff_buf, const int *border_buf)
 {
 	int i, j;
 	float alpha, sum[2][4] = {{ 0.0f }};
@@ -773,35 +836,81 @@ static void xscale_down_ga(unsigned char *in, float *out,
 	}
 }
 
-static void oil_xscale_down(unsigned char *in, float *out,
-	int width_out, enum oil_colorspace cs_in, float *coeff_buf,
-	int *border_buf)
+static void xscale_down_rgb_nogamma(unsigned char *in, float *out,
+	int out_width, const float *coeff_buf, const int *border_buf)
+{
+	int i, j, k;
+	float sum[3][4] = {{ 0.0f }};
+
+	for (i=0; i<out_width; i++) {
+		for (j=0; j<border_buf[i]; j++) {
+			for (k=0; k<3; k++) {
+				add_sample_to_sum_f(i2f_map[in[k]], coeff_buf, sum[k]);
+			}
+			in += 3;
+			coeff_buf += 4;
+		}
+		dump_out(out, sum, 3);
+		out += 3;
+	}
+}
+
+static void xscale_down_rgba_nogamma(unsigned char *in, float *out,
+	int out_width, const float *coeff_buf, const int *border_buf)
+{
+	int i, j, k;
+	float alpha, sum[4][4] = {{ 0.0f }};
+
+	for (i=0; i<out_width; i++) {
+		for (j=0; j<border_buf[i]; j++) {
+			alpha = i2f_map[in[3]];
+			for (k=0; k<3; k++) {
+				add_sample_to_sum_f(i2f_map[in[k]] * alpha, coeff_buf, sum[k]);
+			}
+			add_sample_to_sum_f(alpha, coeff_buf, sum[3]);
+			in += 4;
+			coeff_buf += 4;
+		}
+		dump_out(out, sum, 4);
+		out += 4;
+	}
+}
+
+/**
+ * Horizontal kernels, looked up once per color space and scaling direction.
+ */
+typedef void (*xscale_down_fn)(unsigned char *, float *, int, const float *,
+	const int *);
+typedef void (*xscale_up_fn)(unsigned char *, int, float *, const float *,
+	const int *);
+
+static xscale_down_fn xscale_down_kernel(enum oil_colorspace cs)
 {
-	switch(cs_in) {
+	switch(cs) {
 	case OIL_CS_RGBX:
-		xscale_down_rgbx(in, out, width_out, coeff_buf, border_buf);
-		break;
+		return xscale_down_rgbx;
 	case OIL_CS_RGB:
-		xscale_down_rgb(in, out, width_out, coeff_buf, border_buf);
-		break;
+		return xscale_down_rgb;
 	case OIL_CS_G:
-		xscale_down_g(in, out, width_out, coeff_buf, border_buf);
-		break;
+		return xscale_down_g;
 	case OIL_CS_CMYK:
-		xscale_down_cmyk(in, out, width_out, coeff_buf, border_buf);
-		break;
+	case OIL_CS_RGBX_NOGAMMA:
+		return xscale_down_cmyk;
+	case OIL_CS_RGB_NOGAMMA:
+		return xscale_down_rgb_nogamma;
+	case OIL_CS_RGBA_NOGAMMA:
+		return xscale_down_rgba_nogamma;
 	case OIL_CS_RGBA:
-		xscale_down_rgba(in, out, width_out, coeff_buf, border_buf);
-		break;
+		return xscale_down_rgba;
 	case OIL_CS_GA:
-		xscale_down_ga(in, out, width_out, coeff_buf, border_buf);
-		break;
+		return xscale_down_ga;
 	case OIL_CS_UNKNOWN:
 		break;
 	}
+	return NULL;
 }
 
-static void xscale_up_reduce_n(float in[][4], float *out, float *coeffs,
+static void xscale_up_reduce_n(float in[][4], float *out, const float *coeffs,
 	int cmp)
 {
 	int i;
@@ -815,7 +924,7 @@ static void xscale_up_reduce_n(float in[][4], float *out, float *coeffs,
 }
 
 static void xscale_up_rgbx(unsigned char *in, int width_in, float *out,
-	float *coeff_buf, int *border_buf)
+	const float *coeff_buf, const int *border_buf)
 {
 	int i, j;
 	float smp[3][4] = {{0}};
@@ -835,7 +944,7 @@ static void xscale_up_rgbx(unsigned char *in, int width_in, float *out,
 }
 
 static void xscale_up_rgb(unsigned char *in, int width_in, float *out,
-	float *coeff_buf, int *border_buf)
+	const float *coeff_buf, const int *border_buf)
 {
 	int i, j;
 	float smp[3][4] = {{0}};
@@ -854,7 +963,7 @@ static void xscale_up_rgb(unsigned char *in, int width_in, float *out,
 }
 
 static void xscale_up_cmyk(unsigned char *in, int width_in, float *out,
-	float *coeff_buf, int *border_buf)
+	const float *coeff_buf, const int *border_buf)
 {
 	int i, j;
 	float smp[4][4] = {{0}};
@@ -873,7 +982,7 @@ static void xscale_up_cmyk(unsigned char *in, int width_in, float *out,
 }
 
 static void xscale_up_rgba(unsigned char *in, int width_in, float *out,
-	float *coeff_buf, int *border_buf)
+	const float *coeff_buf, const int *border_buf)
 {
 	int i, j;
 	float smp[4][4] = {{0}};
@@ -893,7 +1002,7 @@ static void xscale_up_rgba(unsigned char *in, int width_in, float *out,
 }
 
 static void xscale_up_ga(unsigned char *in, int width_in, float *out,
-	float *coeff_buf, int *border_buf)
+	const float *coeff_buf, const int *border_buf)
 {
 	int i, j;
 	float smp[2][4] = {{0}};
@@ -911,7 +1020,7 @@ static void xscale_up_ga(unsigned char *in, int width_in, float *out,
 }
 
 static void xscale_up_g(unsigned char *in, int width_in, float *out,
-	float *coeff_buf, int *border_buf)
+	const float *coeff_buf, const int *border_buf)
 {
 	int i, j;
 	float smp[4] = {0};
@@ -929,39 +1038,74 @@ static void xscale_up_g(unsigned char *in, int width_in, float *out,
 	}
 }
 
-static void oil_xscale_up(unsigned char *in, int width_in, float *out,
-	enum oil_colorspace cs_in, float *coeff_buf, int *border_buf)
+static void xscale_up_rgb_nogamma(unsigned char *in, int width_in, float *out,
+	const float *coeff_buf, const int *border_buf)
+{
+	int i, j;
+	float smp[3][4] = {{0}};
+
+	for (i=0; i<width_in; i++) {
+		for (j=0; j<3; j++) {
+			push_f(smp[j], i2f_map[in[j]]);
+		}
+		for (j=0; j<border_buf[i]; j++) {
+			xscale_up_reduce_n(smp, out, coeff_buf, 3);
+			out += 3;
+			coeff_buf += 4;
+		}
+		in += 3;
+	}
+}
+
+static void xscale_up_rgba_nogamma(unsigned char *in, int width_in,
+	float *out, const float *coeff_buf, const int *border_buf)
+{
+	int i, j;
+	float smp[4][4] = {{0}};
+
+	for (i=0; i<width_in; i++) {
+		push_f(smp[3], i2f_map[in[3]]);
+		for (j=0; j<3; j++) {
+			push_f(smp[j], smp[3][3] * i2f_map[in[j]]);
+		}
+		for (j=0; j<border_buf[i]; j++) {
+			xscale_up_reduce_n(smp, out, coeff_buf, 4);
+			out += 4;
+			coeff_buf += 4;
+		}
+		in += 4;
+	}
+}
+
+static xscale_up_fn xscale_up_kernel(enum oil_colorspace cs)
 {
-	switch(cs_in) {
+	switch(cs) {
 	case OIL_CS_RGBX:
-		xscale_up_rgbx(in, width_in, out, coeff_buf, border_buf);
-		break;
+		return xscale_up_rgbx;
 	case OIL_CS_RGB:
-		xscale_up_rgb(in, width_in, out, coeff_buf, border_buf);
-		break;
+		return xscale_up_rgb;
 	case OIL_CS_G:
-		xscale_up_g(in, width_in, out, coeff_buf, border_buf);
-		break;
+		return xscale_up_g;
 	case OIL_CS_CMYK:
-		xscale_up_cmyk(in, width_in, out, coeff_buf, border_buf);
-		break;
+	case OIL_CS_RGBX_NOGAMMA:
+		return xscale_up_cmyk;
+	case OIL_CS_RGB_NOGAMMA:
+		return xscale_up_rgb_nogamma;
+	case OIL_CS_RGBA_NOGAMMA:
+		return xscale_up_rgba_nogamma;
 	case OIL_CS_RGBA:
-		xscale_up_rgba(in, width_in, out, coeff_buf, border_buf);
-		break;
+		return xscale_up_rgba;
 	case OIL_CS_GA:
-		xscale_up_ga(in, width_in, out, coeff_buf, border_buf);
-		break;
+		return xscale_up_ga;
 	case OIL_CS_UNKNOWN:
 		break;
 	}
+	return NULL;
 }
 
 /* Global functions */
 void oil_global_init()
 {
-	build_s2l();
-	build_l2s();
-	build_i2f();
 }
 
 static int calc_coeffs_len(int in_dim, int out_dim)
@@ -978,114 +1122,758 @@ static int calc_borders_len(int in_dim, int out_dim)
 }
 
 static void set_coeffs(int in_dim, int out_dim, float *coeffs, int *borders,
-	float *tmp)
+	float *tmp, enum oil_filter filter)
 {
 	if (out_dim <= in_dim) {
-		xscale_calc_coeffs(in_dim, out_dim, coeffs, borders, tmp);
+		xscale_calc_coeffs(in_dim, out_dim, coeffs, borders, tmp,
+			filter);
 	} else {
-		scale_up_coeffs(in_dim, out_dim, coeffs, borders);
+		scale_up_coeffs(in_dim, out_dim, coeffs, borders, filter);
 	}
 }
 
-int oil_scale_init(struct oil_scale *os, int in_height, int out_height,
-	int in_width, int out_width, enum oil_colorspace cs)
-{
-	int taps_x, taps_y, coeffs_x_len, coeffs_y_len, borders_x_len,
-		borders_y_len, rb_len, sums_len, tmp_len;
+/* Worker threads */
 
-	if (!os || in_height > MAX_DIMENSION || out_height > MAX_DIMENSION ||
-		in_height < 1 || out_height < 1 ||
-		in_width > MAX_DIMENSION || out_width > MAX_DIMENSION ||
-		in_width < 1 || out_width < 1) {
-		return -1;
-	}
+/**
+ * Below this many samples per call the cost of waking up the workers exceeds
+ * the work being split, and the calling thread does everything itself.
+ */
+#define MT_MIN_SAMPLES 65536
 
-	// Lazy perform global init, in case oil_global_ini() hasn't been
-	// called yet.
-	if (!s2l_map[128]) {
-		oil_global_init();
+/**
+ * A minimal fork-join pool. The calling thread runs lane 0 of each job while
+ * the pool threads run lanes 1 to n - 1.
+ */
+struct oil_workers {
+	int n; // number of lanes, the calling thread included.
+	pthread_t *threads;
+	struct worker_lane *lanes;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned long gen; // bumped for every job.
+	int pending; // pool threads still busy with the current job.
+	int quit;
+	void (*fn)(void *, int, int);
+	void *arg;
+};
+
+struct worker_lane {
+	struct oil_workers *w;
+	int lane;
+};
+
+static void *workers_main(void *arg)
+{
+	unsigned long seen;
+	struct worker_lane *l;
+	struct oil_workers *w;
+
+	l = arg;
+	w = l->w;
+	seen = 0;
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->gen == seen && !w->quit) {
+			pthread_cond_wait(&w->start, &w->lock);
+		}
+		if (w->quit) {
+			break;
+		}
+		seen = w->gen;
+		pthread_mutex_unlock(&w->lock);
+		w->fn(w->arg, l->lane, w->n);
+		pthread_mutex_lock(&w->lock);
+		if (--w->pending == 0) {
+			pthread_cond_signal(&w->done);
+		}
 	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
 
-	taps_x = calc_taps(in_width, out_width);
-	taps_y = calc_taps(in_height, out_height);
+static void workers_free(struct oil_workers *w)
+{
+	int i;
 
-	coeffs_x_len = calc_coeffs_len(in_width, out_width);
-	borders_x_len = calc_borders_len(in_width, out_width);
-	coeffs_y_len = calc_coeffs_len(in_height, out_height);
-	borders_y_len = calc_borders_len(in_height, out_height);
-	rb_len = out_width * OIL_CMP(cs) * taps_y * sizeof(float);
-	tmp_len = (taps_x > taps_y ? taps_x : taps_y) * sizeof(float);
-	sums_len = 0;
-	if (out_height <= in_height) {
-		sums_len = out_width * OIL_CMP(cs) * 4 * sizeof(float);
+	if (!w) {
+		return;
 	}
-
-	memset(os, 0, sizeof(struct oil_scale));
-	os->in_height = in_height;
-	os->out_height = out_height;
-	os->in_width = in_width;
-	os->out_width = out_width;
-	os->cs = cs;
-	os->coeffs_x = calloc(1, coeffs_x_len);
-	os->borders_x = calloc(1, borders_x_len);
-	os->coeffs_y = calloc(1, coeffs_y_len);
-	os->borders_y = calloc(1, borders_y_len);
-	os->rb = calloc(1, rb_len);
-	os->sums_y = calloc(1, sums_len);
-	os->tmp_coeffs = malloc(tmp_len);
-
-	if (!os->coeffs_x || !os->borders_x || !os->coeffs_y ||
-		!os->borders_y || !os->rb || !os->tmp_coeffs ||
-		(sums_len && !os->sums_y)) {
-		oil_scale_free(os);
-		return -2;
+	pthread_mutex_lock(&w->lock);
+	w->quit = 1;
+	pthread_cond_broadcast(&w->start);
+	pthread_mutex_unlock(&w->lock);
+	for (i=1; i<w->n; i++) {
+		pthread_join(w->threads[i], NULL);
 	}
-
-	set_coeffs(in_width, out_width, os->coeffs_x, os->borders_x, os->tmp_coeffs);
-	set_coeffs(in_height, out_height, os->coeffs_y, os->borders_y, os->tmp_coeffs);
-
-	return 0;
+	pthread_cond_destroy(&w->done);
+	pthread_cond_destroy(&w->start);
+	pthread_mutex_destroy(&w->lock);
+	free(w->lanes);
+	free(w->threads);
+	free(w);
 }
 
-void oil_scale_restart(struct oil_scale *os)
+/**
+ * Start n - 1 pool threads. If some of them cannot be started the pool simply
+ * gets fewer lanes.
+ */
+static struct oil_workers *workers_new(int n)
 {
-	os->in_pos = os->out_pos = os->rows_in_rb = 0;
-}
+	int i;
+	struct oil_workers *w;
 
-void oil_scale_free(struct oil_scale *os)
-{
-	if (!os) {
-		return;
+	w = calloc(1, sizeof(struct oil_workers));
+	if (!w) {
+		return NULL;
 	}
+	w->threads = calloc(n, sizeof(pthread_t));
+	w->lanes = calloc(n, sizeof(struct worker_lane));
+	if (!w->threads || !w->lanes) {
+		free(w->lanes);
+		free(w->threads);
+		free(w);
+		return NULL;
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->start, NULL);
+	pthread_cond_init(&w->done, NULL);
+	w->n = 1;
+	for (i=1; i<n; i++) {
+		w->lanes[i].w = w;
+		w->lanes[i].lane = i;
+		if (pthread_create(&w->threads[i], NULL, workers_main,
+			&w->lanes[i]) != 0) {
+			break;
+		}
+		w->n++;
+	}
+	if (w->n < 2) {
+		workers_free(w);
+		return NULL;
+	}
+	return w;
+}
+
+static void workers_run(struct oil_workers *w, void (*fn)(void *, int, int),
+	void *arg)
+{
+	pthread_mutex_lock(&w->lock);
+	w->fn = fn;
+	w->arg = arg;
+	w->pending = w->n - 1;
+	w->gen++;
+	pthread_cond_broadcast(&w->start);
+	pthread_mutex_unlock(&w->lock);
+
+	fn(arg, 0, w->n);
+
+	pthread_mutex_lock(&w->lock);
+	while (w->pending > 0) {
+		pthread_cond_wait(&w->done, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Box pre-reduction */
+
+/**
+ * Reductions by BOX_MIN * BOX_TARGET or more are first brought down to between
+ * BOX_TARGET and 2 * BOX_TARGET times the output size with an integer area
+ * average, which costs one addition per sample instead of the 4 multiply-adds
+ * of a catmull-rom filter that would otherwise be hundreds of taps wide.
+ */
+#define BOX_TARGET 2
+
+/**
+ * Smaller boxes do not save enough catmull-rom taps to pay for themselves.
+ */
+#define BOX_MIN 4
+
+static int calc_box(int dim_in, int dim_out)
+{
+	int k;
+
+	k = dim_in / ((double)dim_out * BOX_TARGET);
+	return k < BOX_MIN ? 1 : k;
+}
+
+/**
+ * Boxes are dim_in / dim_pre samples wide on average, rounded down or up so
+ * that the pre-reduced grid stays aligned with the source: returns the first
+ * source sample of box i.
+ */
+static int box_edge(int i, int dim_in, int dim_pre)
+{
+	return (int64_t)i * dim_in / dim_pre;
+}
+
+/**
+ * Accumulate the boxes of a scanline. Colour channels of sRGB images are
+ * summed in 16-bit linear light so that the average is gamma-correct, unless
+ * a _NOGAMMA color space asks otherwise. Alpha channels are used as weights
+ * for the other channels. Each box is summed in
+ * registers before being added to the row sums.
+ */
+static void box_acc_g(unsigned char *in, uint64_t *sums, int start, int end,
+	int in_width, int pre_width, int cmp)
+{
+	int i, j, k, x_end;
+	uint32_t acc[4];
+
+	for (i=start; i<end; i++) {
+		x_end = box_edge(i + 1, in_width, pre_width);
+		acc[0] = acc[1] = acc[2] = acc[3] = 0;
+		for (j=box_edge(i, in_width, pre_width); j<x_end; j++) {
+			for (k=0; k<cmp; k++) {
+				acc[k] += in[j * cmp + k];
+			}
+		}
+		for (k=0; k<cmp; k++) {
+			sums[i * cmp + k] += acc[k];
+		}
+	}
+}
+
+static void box_acc_ga(unsigned char *in, uint64_t *sums, int start, int end,
+	int in_width, int pre_width)
+{
+	int i, j, x_end;
+	uint32_t alpha;
+	uint64_t g, a;
+
+	for (i=start; i<end; i++) {
+		x_end = box_edge(i + 1, in_width, pre_width);
+		g = a = 0;
+		for (j=box_edge(i, in_width, pre_width); j<x_end; j++) {
+			alpha = in[j * 2 + 1];
+			g += in[j * 2] * alpha;
+			a += alpha;
+		}
+		sums[i * 2] += g;
+		sums[i * 2 + 1] += a;
+	}
+}
+
+static void box_acc_rgb(unsigned char *in, uint64_t *sums, int start, int end,
+	int in_width, int pre_width, int cmp)
+{
+	int i, j, x_end;
+	uint64_t r, g, b;
+
+	for (i=start; i<end; i++) {
+		x_end = box_edge(i + 1, in_width, pre_width);
+		r = g = b = 0;
+		for (j=box_edge(i, in_width, pre_width); j<x_end; j++) {
+			r += s2l16_map[in[j * cmp]];
+			g += s2l16_map[in[j * cmp + 1]];
+			b += s2l16_map[in[j * cmp + 2]];
+		}
+		sums[i * cmp] += r;
+		sums[i * cmp + 1] += g;
+		sums[i * cmp + 2] += b;
+	}
+}
+
+static void box_acc_rgba(unsigned char *in, uint64_t *sums, int start,
+	int end, int in_width, int pre_width)
+{
+	int i, j, x_end;
+	uint32_t alpha;
+	uint64_t r, g, b, a;
+
+	for (i=start; i<end; i++) {
+		x_end = box_edge(i + 1, in_width, pre_width);
+		r = g = b = a = 0;
+		for (j=box_edge(i, in_width, pre_width); j<x_end; j++) {
+			alpha = in[j * 4 + 3];
+			r += s2l16_map[in[j * 4]] * alpha;
+			g += s2l16_map[in[j * 4 + 1]] * alpha;
+			b += s2l16_map[in[j * 4 + 2]] * alpha;
+			a += alpha;
+		}
+		sums[i * 4] += r;
+		sums[i * 4 + 1] += g;
+		sums[i * 4 + 2] += b;
+		sums[i * 4 + 3] += a;
+	}
+}
+
+static void box_acc_rgb_nogamma(unsigned char *in, uint64_t *sums,
+	int start, int end, int in_width, int pre_width, int cmp)
+{
+	int i, j, x_end;
+	uint32_t r, g, b;
+
+	for (i=start; i<end; i++) {
+		x_end = box_edge(i + 1, in_width, pre_width);
+		r = g = b = 0;
+		for (j=box_edge(i, in_width, pre_width); j<x_end; j++) {
+			r += in[j * cmp];
+			g += in[j * cmp + 1];
+			b += in[j * cmp + 2];
+		}
+		sums[i * cmp] += r;
+		sums[i * cmp + 1] += g;
+		sums[i * cmp + 2] += b;
+	}
+}
+
+static void box_acc_rgba_nogamma(unsigned char *in, uint64_t *sums,
+	int start, int end, int in_width, int pre_width)
+{
+	int i, j, x_end;
+	uint32_t alpha;
+	uint64_t r, g, b, a;
+
+	for (i=start; i<end; i++) {
+		x_end = box_edge(i + 1, in_width, pre_width);
+		r = g = b = a = 0;
+		for (j=box_edge(i, in_width, pre_width); j<x_end; j++) {
+			alpha = in[j * 4 + 3];
+			r += in[j * 4] * alpha;
+			g += in[j * 4 + 1] * alpha;
+			b += in[j * 4 + 2] * alpha;
+			a += alpha;
+		}
+		sums[i * 4] += r;
+		sums[i * 4 + 1] += g;
+		sums[i * 4 + 2] += b;
+		sums[i * 4 + 3] += a;
+	}
+}
+
+struct box_job {
+	struct oil_scale *os;
+	unsigned char *in;
+};
+
+static void box_in_lane(void *arg, int lane, int lanes)
+{
+	int start, end;
+	struct box_job *job;
+	struct oil_scale *os;
+
+	job = arg;
+	os = job->os;
+	start = os->pre_width * lane / lanes;
+	end = os->pre_width * (lane + 1) / lanes;
+	switch(os->cs) {
+	case OIL_CS_G:
+	case OIL_CS_CMYK:
+		box_acc_g(job->in, os->box_sums, start, end, os->in_width,
+			os->pre_width, OIL_CMP(os->cs));
+		break;
+	case OIL_CS_RGB_NOGAMMA:
+	case OIL_CS_RGBX_NOGAMMA:
+		box_acc_rgb_nogamma(job->in, os->box_sums, start, end,
+			os->in_width, os->pre_width, OIL_CMP(os->cs));
+		break;
+	case OIL_CS_GA:
+		box_acc_ga(job->in, os->box_sums, start, end, os->in_width,
+			os->pre_width);
+		break;
+	case OIL_CS_RGB:
+	case OIL_CS_RGBX:
+		box_acc_rgb(job->in, os->box_sums, start, end, os->in_width,
+			os->pre_width, OIL_CMP(os->cs));
+		break;
+	case OIL_CS_RGBA:
+		box_acc_rgba(job->in, os->box_sums, start, end, os->in_width,
+			os->pre_width);
+		break;
+	case OIL_CS_RGBA_NOGAMMA:
+		box_acc_rgba_nogamma(job->in, os->box_sums, start, end,
+			os->in_width, os->pre_width);
+		break;
+	case OIL_CS_UNKNOWN:
+		break;
+	}
+}
+
+/**
+ * Turn the accumulated sums into the box pre-reduced scanline and clear them.
+ */
+static void box_out(struct oil_scale *os)
+{
+	int i, k, cmp, x_len;
+	uint64_t n, alpha, *sums;
+	unsigned char *out;
+
+	cmp = OIL_CMP(os->cs);
+	sums = os->box_sums;
+	out = os->box_row;
+	for (i=0; i<os->pre_width; i++) {
+		x_len = box_edge(i + 1, os->in_width, os->pre_width) -
+			box_edge(i, os->in_width, os->pre_width);
+		n = (uint64_t)x_len * os->box_rows;
+		switch(os->cs) {
+		case OIL_CS_G:
+		case OIL_CS_CMYK:
+		case OIL_CS_RGB_NOGAMMA:
+		case OIL_CS_RGBX_NOGAMMA:
+			for (k=0; k<cmp; k++) {
+				out[k] = (sums[k] + n / 2) / n;
+			}
+			break;
+		case OIL_CS_GA:
+			alpha = sums[1];
+			out[0] = alpha ? (sums[0] + alpha / 2) / alpha : 0;
+			out[1] = (alpha + n / 2) / n;
+			break;
+		case OIL_CS_RGB:
+		case OIL_CS_RGBX:
+			for (k=0; k<3; k++) {
+				out[k] = linear_sample_to_srgb(sums[k] /
+					(65535.0f * n));
+			}
+			if (cmp == 4) {
+				out[3] = 0;
+			}
+			break;
+		case OIL_CS_RGBA:
+			alpha = sums[3];
+			for (k=0; k<3; k++) {
+				out[k] = alpha ? linear_sample_to_srgb(sums[k] /
+					(65535.0f * alpha)) : 0;
+			}
+			out[3] = (alpha + n / 2) / n;
+			break;
+		case OIL_CS_RGBA_NOGAMMA:
+			alpha = sums[3];
+			for (k=0; k<3; k++) {
+				out[k] = alpha ? (sums[k] + alpha / 2) / alpha : 0;
+			}
+			out[3] = (alpha + n / 2) / n;
+			break;
+		case OIL_CS_UNKNOWN:
+			break;
+		}
+		for (k=0; k<cmp; k++) {
+			sums[k] = 0;
+		}
+		sums += cmp;
+		out += cmp;
+	}
+}
+
+/* Coefficient table cache */
+
+/**
+ * Number of coefficient tables kept around once no scaler references them.
+ * Avatar traffic only ever sees a handful of (source, target) size pairs.
+ */
+#define COEFFS_CACHE_LEN 16
+
+struct oil_coeffs {
+	int in_dim;
+	int out_dim;
+	enum oil_filter filter;
+	int refs; // one per scaler plus one while held by the cache.
+	unsigned long used; // cache clock value of the last lookup.
+	float *coeffs;
+	int *borders;
+};
+
+static struct oil_coeffs *coeffs_cache[COEFFS_CACHE_LEN];
+static unsigned long coeffs_clock;
+static pthread_mutex_t coeffs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void coeffs_free(struct oil_coeffs *c)
+{
+	free(c->coeffs);
+	free(c->borders);
+	free(c);
+}
+
+/**
+ * Drop a reference to a coefficient table. Must be called with coeffs_lock
+ * held.
+ */
+static void coeffs_unref_locked(struct oil_coeffs *c)
+{
+	if (--c->refs == 0) {
+		coeffs_free(c);
+	}
+}
+
+static void coeffs_release(struct oil_coeffs *c)
+{
+	if (!c) {
+		return;
+	}
+	pthread_mutex_lock(&coeffs_lock);
+	coeffs_unref_locked(c);
+	pthread_mutex_unlock(&coeffs_lock);
+}
+
+static struct oil_coeffs *coeffs_build(int in_dim, int out_dim,
+	enum oil_filter filter)
+{
+	struct oil_coeffs *c;
+	float *tmp;
+
+	c = calloc(1, sizeof(struct oil_coeffs));
+	if (!c) {
+		return NULL;
+	}
+	c->in_dim = in_dim;
+	c->out_dim = out_dim;
+	c->filter = filter;
+	c->refs = 1;
+	c->coeffs = calloc(1, calc_coeffs_len(in_dim, out_dim));
+	c->borders = calloc(1, calc_borders_len(in_dim, out_dim));
+	tmp = malloc(calc_taps(in_dim, out_dim, filter) * sizeof(float));
+	if (!c->coeffs || !c->borders || !tmp) {
+		free(tmp);
+		coeffs_free(c);
+		return NULL;
+	}
+	set_coeffs(in_dim, out_dim, c->coeffs, c->borders, tmp, filter);
+	free(tmp);
+	return c;
+}
+
+/**
+ * Look up the coefficient table for the given dimensions and filter, building
+ * and caching it on a miss. The returned table carries a reference for the
+ * caller.
+ */
+static struct oil_coeffs *coeffs_get(int in_dim, int out_dim,
+	enum oil_filter filter)
+{
+	int i, victim;
+	struct oil_coeffs *c, *found;
+
+	found = NULL;
+	pthread_mutex_lock(&coeffs_lock);
+	for (i=0; i<COEFFS_CACHE_LEN; i++) {
+		c = coeffs_cache[i];
+		if (c && c->in_dim == in_dim && c->out_dim == out_dim &&
+			c->filter == filter) {
+			c->refs++;
+			c->used = ++coeffs_clock;
+			found = c;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&coeffs_lock);
+	if (found) {
+		return found;
+	}
+
+	c = coeffs_build(in_dim, out_dim, filter);
+	if (!c) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&coeffs_lock);
+	victim = 0;
+	for (i=0; i<COEFFS_CACHE_LEN; i++) {
+		if (!coeffs_cache[i]) {
+			victim = i;
+			break;
+		}
+		if (coeffs_cache[i]->used < coeffs_cache[victim]->used) {
+			victim = i;
+		}
+	}
+	if (coeffs_cache[victim]) {
+		coeffs_unref_locked(coeffs_cache[victim]);
+	}
+	c->refs++;
+	c->used = ++coeffs_clock;
+	coeffs_cache[victim] = c;
+	pthread_mutex_unlock(&coeffs_lock);
+	return c;
+}
+
+void oil_coeffs_flush(void)
+{
+	int i;
+
+	pthread_mutex_lock(&coeffs_lock);
+	for (i=0; i<COEFFS_CACHE_LEN; i++) {
+		if (coeffs_cache[i]) {
+			coeffs_unref_locked(coeffs_cache[i]);
+			coeffs_cache[i] = NULL;
+		}
+	}
+	pthread_mutex_unlock(&coeffs_lock);
+}
+
+/**
+ * Map an sRGB color space to its variant resampled in gamma space.
+ */
+static enum oil_colorspace nogamma_cs(enum oil_colorspace cs)
+{
+	switch(cs) {
+	case OIL_CS_RGB:
+		return OIL_CS_RGB_NOGAMMA;
+	case OIL_CS_RGBX:
+		return OIL_CS_RGBX_NOGAMMA;
+	case OIL_CS_RGBA:
+		return OIL_CS_RGBA_NOGAMMA;
+	default:
+		return cs;
+	}
+}
+
+int oil_scale_init(struct oil_scale *os, int in_height, int out_height,
+	int in_width, int out_width, enum oil_colorspace cs)
+{
+	return oil_scale_init_opts(os, in_height, out_height, in_width,
+		out_width, cs, NULL);
+}
+
+int oil_scale_init_opts(struct oil_scale *os, int in_height, int out_height,
+	int in_width, int out_width, enum oil_colorspace cs,
+	const struct oil_scale_opts *opts)
+{
+	int taps_y, rb_len, sums_len, box_x, box_y, pre_width, pre_height;
+	enum oil_filter filter;
+
+	filter = opts ? opts->filter : OIL_FILTER_CATROM;
+	if (opts && opts->nogamma) {
+		cs = nogamma_cs(cs);
+	}
+	if (!os || in_height > MAX_DIMENSION || out_height > MAX_DIMENSION ||
+		in_height < 1 || out_height < 1 ||
+		in_width > MAX_DIMENSION || out_width > MAX_DIMENSION ||
+		in_width < 1 || out_width < 1 ||
+		filter < 0 || filter >= OIL_FILTER__MAX) {
+		return -1;
+	}
+
+	box_x = calc_box(in_width, out_width);
+	box_y = calc_box(in_height, out_height);
+	pre_width = in_width / box_x;
+	pre_height = in_height / box_y;
+
+	taps_y = calc_taps(pre_height, out_height, filter);
+
+	rb_len = out_width * OIL_CMP(cs) * taps_y * sizeof(float);
+	sums_len = 0;
+	if (out_height <= pre_height) {
+		sums_len = out_width * OIL_CMP(cs) * 4 * sizeof(float);
+	}
+
+	memset(os, 0, sizeof(struct oil_scale));
+	os->in_height = in_height;
+	os->out_height = out_height;
+	os->in_width = in_width;
+	os->out_width = out_width;
+	os->cs = cs;
+	os->filter = filter;
+	os->box_x = box_x;
+	os->box_y = box_y;
+	os->pre_width = pre_width;
+	os->pre_height = pre_height;
+	os->tables_x = coeffs_get(pre_width, out_width, filter);
+	os->tables_y = coeffs_get(pre_height, out_height, filter);
+	os->rb = calloc(1, rb_len);
+	os->sums_y = calloc(1, sums_len);
+	if (box_x > 1 || box_y > 1) {
+		os->box_sums = calloc(pre_width * OIL_CMP(cs),
+			sizeof(uint64_t));
+		os->box_row = malloc(pre_width * OIL_CMP(cs));
+		if (!os->box_sums || !os->box_row) {
+			oil_scale_free(os);
+			return -2;
+		}
+	}
+
+	if (!os->tables_x || !os->tables_y || !os->rb ||
+		(sums_len && !os->sums_y)) {
+		oil_scale_free(os);
+		return -2;
+	}
+
+	os->coeffs_x = os->tables_x->coeffs;
+	os->borders_x = os->tables_x->borders;
+	os->coeffs_y = os->tables_y->coeffs;
+	os->borders_y = os->tables_y->borders;
+
+	return 0;
+}
+
+void oil_scale_reset(struct oil_scale *os)
+{
+	int cmp;
+
+	cmp = OIL_CMP(os->cs);
+	os->in_pos = os->out_pos = os->rows_in_rb = os->rows_out = 0;
+	os->box_rows = 0;
+	if (os->box_sums) {
+		memset(os->box_sums, 0,
+			os->pre_width * cmp * sizeof(uint64_t));
+	}
+
+	/* sums carried over from the last row of an unfinished image */
+	if (os->out_height <= os->pre_height) {
+		memset(os->sums_y, 0, os->out_width * cmp * 4 * sizeof(float));
+	} else {
+		memset(os->rb, 0, 4 * os->out_width * cmp * sizeof(float));
+	}
+}
+
+void oil_scale_restart(struct oil_scale *os)
+{
+	oil_scale_reset(os);
+}
 
+int oil_scale_set_threads(struct oil_scale *os, int nthreads)
+{
+	workers_free(os->workers);
+	os->workers = NULL;
+	if (nthreads < 2) {
+		return 0;
+	}
+	os->workers = workers_new(nthreads);
+	return os->workers ? 0 : -2;
+}
+
+void oil_scale_free(struct oil_scale *os)
+{
+	if (!os) {
+		return;
+	}
+
+	workers_free(os->workers);
+	os->workers = NULL;
 	free(os->rb);
 	os->rb = NULL;
-	free(os->coeffs_y);
+	coeffs_release(os->tables_y);
+	os->tables_y = NULL;
 	os->coeffs_y = NULL;
-	free(os->coeffs_x);
+	os->borders_y = NULL;
+	coeffs_release(os->tables_x);
+	os->tables_x = NULL;
 	os->coeffs_x = NULL;
-	free(os->borders_x);
 	os->borders_x = NULL;
-	free(os->borders_y);
-	os->borders_y = NULL;
 	free(os->sums_y);
 	os->sums_y = NULL;
-	free(os->tmp_coeffs);
-	os->tmp_coeffs = NULL;
+	free(os->box_sums);
+	os->box_sums = NULL;
+	free(os->box_row);
+	os->box_row = NULL;
 }
 
-int oil_scale_slots(struct oil_scale *ys)
+/**
+ * Number of pre-reduced rows needed before the next output row.
+ */
+static int pre_slots(struct oil_scale *ys)
 {
 	int i;
 
-	if (ys->out_height <= ys->in_height) {
-		return ys->borders_y[ys->out_pos];
+	if (ys->out_height <= ys->pre_height) {
+		return ys->borders_y[ys->out_pos] - ys->rows_in_rb;
 	} else {
 		if (ys->in_pos == 0) {
 			for (i=1; ys->borders_y[i - 1] == 0; i++);
 			return i;
 		}
-		if (ys->borders_y[ys->in_pos - 1] > 0) {
+		if (ys->borders_y[ys->in_pos - 1] > ys->rows_out) {
 			return 0;
 		}
 		for (i=1; ys->borders_y[ys->in_pos + i - 1] == 0; i++);
@@ -1093,6 +1881,19 @@ int oil_scale_slots(struct oil_scale *ys)
 	}
 }
 
+int oil_scale_slots(struct oil_scale *ys)
+{
+	int n;
+
+	n = pre_slots(ys);
+	if (ys->box_y == 1) {
+		return n;
+	}
+	return box_edge(ys->in_pos + n, ys->in_height, ys->pre_height) -
+		box_edge(ys->in_pos, ys->in_height, ys->pre_height) -
+		ys->box_rows;
+}
+
 static float *get_rb_line(struct oil_scale *os, int line)
 {
 	int sl_len;
@@ -1100,49 +1901,285 @@ static float *get_rb_line(struct oil_scale *os, int line)
 	return os->rb + line * sl_len;
 }
 
-void oil_scale_in(struct oil_scale *os, unsigned char *in)
+/**
+ * Horizontally scale rows start to end of the input rows about to be ingested
+ * into their ring buffer lines. The kernel and the ring buffer layout are
+ * resolved once for the whole block.
+ */
+static void xscale_rows(struct oil_scale *os, unsigned char **in, int start,
+	int end)
 {
+	int k;
 	float *tmp;
+	xscale_down_fn down;
+	xscale_up_fn up;
 
-	if (os->out_height <= os->in_height) {
-		tmp = get_rb_line(os, os->rows_in_rb);
+	down = NULL;
+	up = NULL;
+	if (os->out_width <= os->pre_width) {
+		down = xscale_down_kernel(os->cs);
 	} else {
-		tmp = get_rb_line(os, os->in_pos % 4);
+		up = xscale_up_kernel(os->cs);
+	}
+	for (k=start; k<end; k++) {
+		if (os->out_height <= os->pre_height) {
+			tmp = get_rb_line(os, os->rows_in_rb + k);
+		} else {
+			tmp = get_rb_line(os, (os->in_pos + k) % 4);
+		}
+		if (down) {
+			down(in[k], tmp, os->out_width, os->coeffs_x,
+				os->borders_x);
+		} else {
+			up(in[k], os->pre_width, tmp, os->coeffs_x,
+				os->borders_x);
+		}
 	}
-	if (os->out_width <= os->in_width) {
-		oil_xscale_down(in, tmp, os->out_width, os->cs,
-			os->coeffs_x, os->borders_x);
+}
+
+struct in_job {
+	struct oil_scale *os;
+	unsigned char **in;
+	int n;
+};
+
+static void scale_in_lane(void *arg, int lane, int lanes)
+{
+	struct in_job *job;
+
+	job = arg;
+	xscale_rows(job->os, job->in, job->n * lane / lanes,
+		job->n * (lane + 1) / lanes);
+}
+
+static void pre_in_rows(struct oil_scale *os, unsigned char **in, int n)
+{
+	struct in_job job;
+
+	job.os = os;
+	job.in = in;
+	job.n = n;
+	if (os->workers && n > 1 &&
+		n * os->pre_width * OIL_CMP(os->cs) >= MT_MIN_SAMPLES) {
+		workers_run(os->workers, scale_in_lane, &job);
 	} else {
-		oil_xscale_up(in, os->in_width, tmp, os->cs,
-			os->coeffs_x, os->borders_x);
+		scale_in_lane(&job, 0, 1);
 	}
+	os->rows_in_rb += n;
+	os->rows_out = 0;
+	os->in_pos += n;
+}
+
+/**
+ * Accumulate source rows into the current box row, handing it to the
+ * catmull-rom passes whenever it is complete.
+ */
+static void box_in_rows(struct oil_scale *os, unsigned char **in, int n)
+{
+	int i, box_height;
+	struct box_job job;
+
+	job.os = os;
+	for (i=0; i<n; i++) {
+		job.in = in[i];
+		if (os->workers && os->in_width * OIL_CMP(os->cs) >=
+			MT_MIN_SAMPLES) {
+			workers_run(os->workers, box_in_lane, &job);
+		} else {
+			box_in_lane(&job, 0, 1);
+		}
+		os->box_rows++;
+		box_height = box_edge(os->in_pos + 1, os->in_height,
+			os->pre_height) - box_edge(os->in_pos, os->in_height,
+			os->pre_height);
+		if (os->box_rows == box_height) {
+			box_out(os);
+			pre_in_rows(os, &os->box_row, 1);
+			os->box_rows = 0;
+		}
+	}
+}
+
+void oil_scale_in_rows(struct oil_scale *os, unsigned char **in, int n)
+{
+	if (os->box_row) {
+		box_in_rows(os, in, n);
+	} else {
+		pre_in_rows(os, in, n);
+	}
+}
+
+void oil_scale_in(struct oil_scale *os, unsigned char *in)
+{
+	if (os->box_row) {
+		box_in_rows(os, &in, 1);
+		return;
+	}
+	xscale_rows(os, &in, 0, 1);
 	os->rows_in_rb++;
+	os->rows_out = 0;
 	os->in_pos++;
 }
 
-void oil_scale_out(struct oil_scale *os, unsigned char *out)
+struct out_job {
+	struct oil_scale *os;
+	unsigned char *out;
+	const float *coeffs;
+	float *in[4];
+};
+
+/**
+ * Produce one band of columns of the next output scanline. Every column is
+ * independent in the vertical pass, so bands need no overlap.
+ */
+static void scale_out_lane(void *arg, int lane, int lanes)
 {
-	int i, sl_len;
-	float *coeffs, *in[4];
+	int i, cmp, sl_len, start, len;
+	float *in[4];
+	struct out_job *job;
+	struct oil_scale *os;
+
+	job = arg;
+	os = job->os;
+	cmp = OIL_CMP(os->cs);
+	sl_len = cmp * os->out_width;
+	start = os->out_width * lane / lanes * cmp;
+	len = os->out_width * (lane + 1) / lanes * cmp - start;
+	if (os->out_height <= os->pre_height) {
+		yscale_down(os->rb + start, os->rows_in_rb, sl_len, len,
+			job->out + start, job->coeffs, os->sums_y + start * 4,
+			os->cs);
+	} else {
+		for (i=0; i<4; i++) {
+			in[i] = job->in[i] + start;
+		}
+		yscale_up(in, len, job->coeffs, job->out + start, os->cs);
+	}
+}
 
-	sl_len = OIL_CMP(os->cs) * os->out_width;
-	if (os->out_height <= os->in_height) {
-		coeffs = os->coeffs_y + (os->in_pos - os->rows_in_rb) * 4;
-		yscale_down(os->rb, os->rows_in_rb, sl_len, out, coeffs,
-			os->sums_y, os->cs);
-		os->rows_in_rb = 0;
+void oil_scale_out(struct oil_scale *os, unsigned char *out)
+{
+	int i, strip_height;
+	struct out_job job;
+
+	job.os = os;
+	job.out = out;
+	if (os->out_height <= os->pre_height) {
+		job.coeffs = os->coeffs_y + (os->in_pos - os->rows_in_rb) * 4;
+		strip_height = os->rows_in_rb;
 	} else {
 		for (i=0; i<4; i++) {
-			in[i] = get_rb_line(os, (os->in_pos + i) % 4);
+			job.in[i] = get_rb_line(os, (os->in_pos + i) % 4);
 		}
-		yscale_up(in, sl_len, os->coeffs_y + os->out_pos * 4, out,
-			os->cs);
-		os->borders_y[os->in_pos - 1] -= 1;
+		job.coeffs = os->coeffs_y + os->out_pos * 4;
+		strip_height = 4;
+	}
+	if (os->workers && strip_height * os->out_width * OIL_CMP(os->cs) >=
+		MT_MIN_SAMPLES) {
+		workers_run(os->workers, scale_out_lane, &job);
+	} else {
+		scale_out_lane(&job, 0, 1);
 	}
 
+	if (os->out_height <= os->pre_height) {
+		os->rows_in_rb = 0;
+	} else {
+		os->rows_out++;
+	}
 	os->out_pos++;
 }
 
+int oil_scale_out_rows(struct oil_scale *os, unsigned char **out, int n)
+{
+	int i;
+
+	for (i=0; i<n && os->out_pos < os->out_height; i++) {
+		if (i > 0 && oil_scale_slots(os) != 0) {
+			break;
+		}
+		oil_scale_out(os, out[i]);
+	}
+	return i;
+}
+
+int oil_multi_scale_init(struct oil_multi_scale *ms, int n, int in_height,
+	int in_width, const int *out_heights, const int *out_widths,
+	enum oil_colorspace cs, const struct oil_scale_opts *opts)
+{
+	int i, ret;
+
+	if (!ms || n < 1) {
+		return -1;
+	}
+	ms->n = 0;
+	ms->os = calloc(n, sizeof(struct oil_scale));
+	ms->outbufs = calloc(n, sizeof(unsigned char *));
+	if (!ms->os || !ms->outbufs) {
+		free(ms->os);
+		free(ms->outbufs);
+		return -2;
+	}
+	for (i=0; i<n; i++) {
+		ret = oil_scale_init_opts(ms->os + i, in_height, out_heights[i],
+			in_width, out_widths[i], cs, opts ? opts + i : NULL);
+		if (ret != 0) {
+			oil_multi_scale_free(ms);
+			return ret;
+		}
+		ms->n++;
+		ms->outbufs[i] = malloc(out_widths[i] * OIL_CMP(ms->os[i].cs));
+		if (!ms->outbufs[i]) {
+			oil_multi_scale_free(ms);
+			return -2;
+		}
+	}
+	return 0;
+}
+
+void oil_multi_scale_free(struct oil_multi_scale *ms)
+{
+	int i;
+
+	for (i=0; i<ms->n; i++) {
+		oil_scale_free(ms->os + i);
+		free(ms->outbufs[i]);
+	}
+	free(ms->os);
+	free(ms->outbufs);
+	ms->os = NULL;
+	ms->outbufs = NULL;
+	ms->n = 0;
+}
+
+void oil_multi_scale_in(struct oil_multi_scale *ms, unsigned char *in)
+{
+	int i;
+	struct oil_scale *os;
+
+	for (i=0; i<ms->n; i++) {
+		os = ms->os + i;
+		if (os->out_pos < os->out_height && oil_scale_slots(os) > 0) {
+			oil_scale_in(os, in);
+		}
+	}
+}
+
+int oil_multi_scale_out(struct oil_multi_scale *ms, unsigned char **out)
+{
+	int i;
+	struct oil_scale *os;
+
+	for (i=0; i<ms->n; i++) {
+		os = ms->os + i;
+		if (os->out_pos < os->out_height && oil_scale_slots(os) == 0) {
+			oil_scale_out(os, ms->outbufs[i]);
+			*out = ms->outbufs[i];
+			return i;
+		}
+	}
+	return -1;
+}
+
 int oil_fix_ratio(int src_width, int src_height, int *out_width,
 	int *out_height)
 {
@@ -22,6 +22,8 @@
 #ifndef OIL_RESAMPLE_H
 #define OIL_RESAMPLE_H
 
+#include <stdint.h>
+
 /**
  * Color spaces currently supported by oil.
  */
@@ -46,6 +48,41 @@ enum oil_colorspace {
 
 	// no color space conversions
 	OIL_CS_CMYK    = 0x0204,
+
+	// sRGB variants resampled directly in gamma space. Faster, but dark
+	// and light details are not mixed in linear light.
+	OIL_CS_RGB_NOGAMMA  = 0x0103,
+	OIL_CS_RGBX_NOGAMMA = 0x0304,
+	OIL_CS_RGBA_NOGAMMA = 0x0404,
+};
+
+/**
+ * Resampling kernels.
+ */
+enum oil_filter {
+	// Catmull-Rom, the default.
+	OIL_FILTER_CATROM = 0,
+
+	// Box, nearest neighbour when upscaling. Fast but blocky.
+	OIL_FILTER_BOX,
+
+	// Triangle, bilinear interpolation when upscaling. Softer than
+	// Catmull-Rom.
+	OIL_FILTER_TRIANGLE,
+
+	// Lanczos with 2 lobes. Sharpest, with slightly more ringing.
+	OIL_FILTER_LANCZOS2,
+
+	OIL_FILTER__MAX
+};
+
+/**
+ * Optional settings for oil_scale_init_opts(). A zeroed struct selects the
+ * defaults.
+ */
+struct oil_scale_opts {
+	enum oil_filter filter; // resampling kernel.
+	int nogamma; // swap sRGB color spaces for their _NOGAMMA variant.
 };
 
 /**
@@ -53,6 +90,18 @@ enum oil_colorspace {
  */
 #define OIL_CMP(x) ((x)&0xFF)
 
+/**
+ * Immutable coefficient & border tables for one scaling axis. Opaque, shared
+ * between scalers through a small cache keyed by input and output dimension
+ * and filter.
+ */
+struct oil_coeffs;
+
+/**
+ * Opaque pool of worker threads, see oil_scale_set_threads().
+ */
+struct oil_workers;
+
 /**
  * Struct to hold state for scaling. Changing these will produce unpredictable
  * results.
@@ -63,31 +112,49 @@ struct oil_scale {
 	int in_width; // input image width.
 	int out_width; // output image height.
 	enum oil_colorspace cs; // color space of input & output.
+	enum oil_filter filter; // resampling kernel.
 	int in_pos; // current row of input image.
 	int out_pos; // current row of output image.
 
-	float *coeffs_y; // buffer for holding temporary y-coefficients.
-	float *coeffs_x; // buffer for holding precalculated coefficients.
-	int *borders_x; // holds precalculated coefficient rotation points.
-	int *borders_y; // coefficient rotation points for y-scaling.
+	struct oil_coeffs *tables_x; // shared x-coefficients and borders.
+	struct oil_coeffs *tables_y; // shared y-coefficients and borders.
+	const float *coeffs_y; // precalculated y-coefficients.
+	const float *coeffs_x; // precalculated x-coefficients.
+	const int *borders_x; // holds precalculated coefficient rotation points.
+	const int *borders_y; // coefficient rotation points for y-scaling.
 	float *sums_y; // buffer of intermediate sums for y-scaling.
 	float *rb; // ring buffer holding scanlines.
 	int rows_in_rb; // number of rows currently in the ring buffer.
-	float *tmp_coeffs; // temporary buffer for calculating coeffs.
+	int rows_out; // output rows produced from the last input row (upscale).
+	struct oil_workers *workers; // optional threads sharing the work.
+	int box_x; // horizontal box pre-reduction factor, 1 if unused.
+	int box_y; // vertical box pre-reduction factor, 1 if unused.
+	int pre_width; // input width after box pre-reduction.
+	int pre_height; // input height after box pre-reduction.
+	int box_rows; // input rows accumulated in box_sums.
+	uint64_t *box_sums; // per-sample sums of the current box row.
+	unsigned char *box_row; // box pre-reduced scanline.
 };
 
 /**
- * Initialize static, pre-calculated tables. This only needs to be called once.
- * A call to oil_scale_init() will initialize these tables if not already done,
- * so explicityly calling oil_global_init() is only needed if there are
- * concurrency concerns.
+ * The sRGB/linear lookup tables are generated at build time by oil_gentables
+ * and live in read-only memory, so there is nothing left to initialize. Kept
+ * for compatibility, calling it is never required.
  */
 void oil_global_init(void);
 
+/**
+ * Drop every coefficient table held by the cache. Tables still referenced by a
+ * live scaler are freed when that scaler is freed.
+ */
+void oil_coeffs_flush(void);
+
 /**
  * Reset an already-initialized oil_scale struct. This allows you to re-use an
  * oil_scale struct when the input & output dimensions as well as the colorspace
- * will be the same.
+ * will be the same. Buffers, coefficient tables and threads are kept, so the
+ * next image is scaled without allocating anything. The previous image does
+ * not have to be complete.
  */
 void oil_scale_reset(struct oil_scale *os);
 
@@ -108,11 +175,42 @@ int oil_scale_init(struct oil_scale *os, int in_height, int out_height,
 	int in_width, int out_width, enum oil_colorspace cs);
 
 /**
- * Reset rows countersin an oil scaler struct.
+ * Initialize an oil scaler struct with non-default settings.
+ * @os: Pointer to the scaler struct to be initialized.
+ * @in_height: Height, in pixels, of the input image.
+ * @out_height: Height, in pixels, of the output image.
+ * @in_width: Width, in pixels, of the input image.
+ * @out_width: Width, in pixels, of the output image.
+ * @cs: Color space of the input/output images.
+ * @opts: Settings, or NULL for the defaults of oil_scale_init().
+ *
+ * Returns 0 on success.
+ * Returns -1 if an argument is bad.
+ * Returns -2 if unable to allocate memory.
+ */
+int oil_scale_init_opts(struct oil_scale *os, int in_height, int out_height,
+	int in_width, int out_width, enum oil_colorspace cs,
+	const struct oil_scale_opts *opts);
+
+/**
+ * Same as oil_scale_reset(), kept for compatibility.
  * @os: Pointer to the scaler struct to be reseted.
  */
 void oil_scale_restart(struct oil_scale *);
 
+/**
+ * Split the work of a scaler over several threads. Rows given together to
+ * oil_scale_in_rows() are scaled horizontally in parallel, and the vertical
+ * pass of oil_scale_out() is split in bands of columns.
+ * @os: Pointer to an initialized scaler struct.
+ * @nthreads: Thread budget, the calling thread included. Values below 2
+ * disable threading.
+ *
+ * Returns 0 on success.
+ * Returns -2 if unable to start any thread, the scaler then stays sequential.
+ */
+int oil_scale_set_threads(struct oil_scale *os, int nthreads);
+
 /**
  * Free heap allocations associated with a yscaler struct.
  * @os: Pointer to the yscaler struct to be freed.
@@ -136,6 +234,14 @@ int oil_scale_slots(struct oil_scale *os);
  */
 void oil_scale_in(struct oil_scale *os, unsigned char *in);
 
+/**
+ * Ingest & buffer several input scanlines at once.
+ * @os: Pointer to the scaler struct.
+ * @in: Array of pointers to the input scanlines.
+ * @n: Number of scanlines, at most what oil_scale_slots() returned.
+ */
+void oil_scale_in_rows(struct oil_scale *os, unsigned char **in, int n);
+
 /**
  * Scale previously ingested & buffered contents to produce the next scaled output
  * scanline.
@@ -144,6 +250,70 @@ void oil_scale_in(struct oil_scale *os, unsigned char *in);
  */
 void oil_scale_out(struct oil_scale *os, unsigned char *out);
 
+/**
+ * Produce as many of the next n output scanlines as the buffered input allows.
+ * The first one must be ready, as for oil_scale_out().
+ * @os: Pointer to the scaler struct.
+ * @out: Array of pointers to the output scanline buffers.
+ * @n: Maximum number of scanlines to produce.
+ *
+ * Returns the number of scanlines produced.
+ */
+int oil_scale_out_rows(struct oil_scale *os, unsigned char **out, int n);
+
+/**
+ * Several scalers sharing one input image, so that a source decoded once can
+ * be scaled to many sizes.
+ */
+struct oil_multi_scale {
+	int n; // number of outputs.
+	struct oil_scale *os; // one scaler per output.
+	unsigned char **outbufs; // one output scanline buffer per output.
+};
+
+/**
+ * Initialize a multi-output scaler.
+ * @ms: Pointer to the struct to be initialized.
+ * @n: Number of outputs.
+ * @in_height: Height, in pixels, of the input image.
+ * @in_width: Width, in pixels, of the input image.
+ * @out_heights: Heights, in pixels, of the n output images.
+ * @out_widths: Widths, in pixels, of the n output images.
+ * @cs: Color space of the input/output images.
+ * @opts: Settings for each of the n outputs, or NULL for the defaults.
+ *
+ * Returns 0 on success.
+ * Returns -1 if an argument is bad.
+ * Returns -2 if unable to allocate memory.
+ */
+int oil_multi_scale_init(struct oil_multi_scale *ms, int n, int in_height,
+	int in_width, const int *out_heights, const int *out_widths,
+	enum oil_colorspace cs, const struct oil_scale_opts *opts);
+
+/**
+ * Free heap allocations associated with a multi-output scaler.
+ */
+void oil_multi_scale_free(struct oil_multi_scale *ms);
+
+/**
+ * Feed the next input scanline to every output that still needs input. Call
+ * oil_multi_scale_out() until it returns -1 before feeding the next scanline.
+ * @ms: Pointer to the multi-output scaler struct.
+ * @in: Pointer to the input buffer containing a scanline.
+ */
+void oil_multi_scale_in(struct oil_multi_scale *ms, unsigned char *in);
+
+/**
+ * Produce the next output scanline that can be produced from the input fed so
+ * far, from any of the outputs.
+ * @ms: Pointer to the multi-output scaler struct.
+ * @out: Set to the scanline, valid until the next call.
+ *
+ * Returns the index of the output the scanline belongs to.
+ * Returns -1 if every output needs more input or is complete.
+ */
+int oil_multi_scale_out(struct oil_multi_scale *ms, unsigned char **out);
+
 /**
  * Calculate an output ratio that preserves the input aspect ratio.
  * @src_width: Width, in pixels, of the input image.
@@ -0,0 +1,194 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include "oil_spng.h"
+
+#if HAVE_SPNG
+#include <spng.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct oil_spng {
+	spng_ctx *ctx;
+	int fmt; // SPNG_FMT_* the rows are decoded to.
+	int flags; // SPNG_DECODE_* flags.
+};
+
+static void spng_fail(struct oil_decoder *dec, unsigned char **rows, int n)
+{
+	int i;
+
+	dec->error = 1;
+	for (i=0; i<n; i++) {
+		memset(rows[i], 0, dec->rowbytes);
+	}
+}
+
+static void spng_read_rows(struct oil_decoder *dec, unsigned char **rows,
+	int n)
+{
+	int i, ret;
+	struct oil_spng *sp;
+
+	sp = dec->ctx;
+	for (i=0; i<n && !dec->error; i++) {
+		ret = spng_decode_row(sp->ctx, rows[i], dec->rowbytes);
+		// the last row comes with SPNG_EOI
+		if (ret != 0 && ret != SPNG_EOI) {
+			break;
+		}
+	}
+	if (i < n) {
+		spng_fail(dec, rows + i, n - i);
+	}
+}
+
+static void spng_read_image(struct oil_decoder *dec, unsigned char **rows)
+{
+	int i;
+	size_t len;
+	unsigned char *buf;
+	struct oil_spng *sp;
+
+	sp = dec->ctx;
+	len = (size_t)dec->rowbytes * dec->height;
+	buf = malloc(len);
+	if (!buf || spng_decode_image(sp->ctx, buf, len, sp->fmt,
+		sp->flags) != 0) {
+		free(buf);
+		spng_fail(dec, rows, dec->height);
+		return;
+	}
+	for (i=0; i<dec->height; i++) {
+		memcpy(rows[i], buf + (size_t)i * dec->rowbytes, dec->rowbytes);
+	}
+	free(buf);
+}
+
+static void spng_free(struct oil_decoder *dec)
+{
+	struct oil_spng *sp;
+
+	sp = dec->ctx;
+	spng_ctx_free(sp->ctx);
+	free(sp);
+}
+
+/**
+ * Output format matching what libpng delivers for the source, with
+ * png_set_expand() and png_set_strip_16(). Returns -1 where the two could
+ * differ.
+ */
+static int spng_format(spng_ctx *ctx, const struct spng_ihdr *ihdr,
+	struct oil_spng *sp, enum oil_colorspace *cs)
+{
+	int trns;
+	struct spng_trns t;
+
+	if (ihdr->bit_depth != 8) {
+		return -1;
+	}
+	trns = spng_get_trns(ctx, &t) == 0;
+	sp->flags = 0;
+	switch (ihdr->color_type) {
+	case SPNG_COLOR_TYPE_GRAYSCALE:
+		if (trns) {
+			return -1;
+		}
+		sp->fmt = SPNG_FMT_G8;
+		*cs = OIL_CS_G;
+		return 0;
+	case SPNG_COLOR_TYPE_GRAYSCALE_ALPHA:
+		sp->fmt = SPNG_FMT_GA8;
+		*cs = OIL_CS_GA;
+		return 0;
+	case SPNG_COLOR_TYPE_TRUECOLOR:
+	case SPNG_COLOR_TYPE_INDEXED:
+		if (trns) {
+			sp->fmt = SPNG_FMT_RGBA8;
+			sp->flags = SPNG_DECODE_TRNS;
+			*cs = OIL_CS_RGBA;
+		} else {
+			sp->fmt = SPNG_FMT_RGB8;
+			*cs = OIL_CS_RGB;
+		}
+		return 0;
+	case SPNG_COLOR_TYPE_TRUECOLOR_ALPHA:
+		sp->fmt = SPNG_FMT_RGBA8;
+		*cs = OIL_CS_RGBA;
+		return 0;
+	}
+	return -1;
+}
+
+int oil_decoder_spng(struct oil_decoder *dec, FILE *input)
+{
+	size_t len;
+	struct spng_ihdr ihdr;
+	struct oil_spng *sp;
+	enum oil_colorspace cs;
+
+	memset(dec, 0, sizeof(struct oil_decoder));
+	sp = calloc(1, sizeof(struct oil_spng));
+	if (!sp) {
+		return -2;
+	}
+	sp->ctx = spng_ctx_new(0);
+	if (!sp->ctx) {
+		free(sp);
+		return -2;
+	}
+	if (spng_set_png_file(sp->ctx, input) != 0 ||
+		spng_get_ihdr(sp->ctx, &ihdr) != 0 ||
+		spng_format(sp->ctx, &ihdr, sp, &cs) != 0 ||
+		spng_decoded_image_size(sp->ctx, sp->fmt, &len) != 0) {
+		spng_ctx_free(sp->ctx);
+		free(sp);
+		return -1;
+	}
+	dec->width = ihdr.width;
+	dec->height = ihdr.height;
+	dec->cs = cs;
+	dec->rowbytes = len / ihdr.height;
+	dec->interlaced = ihdr.interlace_method != SPNG_INTERLACE_NONE;
+	dec->read_rows = spng_read_rows;
+	dec->read_image = spng_read_image;
+	dec->free = spng_free;
+	dec->ctx = sp;
+
+	// rows are pulled one by one from here on
+	if (!dec->interlaced && spng_decode_image(sp->ctx, NULL, 0, sp->fmt,
+		sp->flags | SPNG_DECODE_PROGRESSIVE) != 0) {
+		spng_free(dec);
+		return -1;
+	}
+	return 0;
+}
+#else
+int oil_decoder_spng(struct oil_decoder *dec, FILE *input)
+{
+	(void)dec;
+	(void)input;
+	return -1;
+}
+#endif
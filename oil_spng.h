@@ -0,0 +1,41 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef OIL_SPNG_H
+#define OIL_SPNG_H
+
+#include <stdio.h>
+#include "oil_libpng.h"
+
+/**
+ * Decode with libspng, which unfilters with SIMD, into the same rows libpng
+ * delivers when set up for oil_libpng: palettes and tRNS expanded. Only 8-bit
+ * sources are taken, the others are left to libpng. Release the decoder with
+ * oil_decoder_free().
+ *
+ * Returns 0 on success.
+ * Returns -1 if built without libspng or if the source is not taken. Some of
+ * the input may have been read then.
+ * Returns -2 if unable to allocate memory.
+ */
+int oil_decoder_spng(struct oil_decoder *dec, FILE *input);
+
+#endif
@@ -19,137 +19,536 @@
  * THE SOFTWARE.
  */
 
+#include <sys/types.h>
+
 #include "oil_resample.h"
 #include "oil_libpng.h"
+#include "oil_spng.h"
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <png.h>
 
 #include "libravatar.h"
+#include "lgpng.h"
 
-static void my_png_writer(png_struct *, png_byte *, size_t);
-static void my_png_flusher(png_struct *);
 static void user_error(png_struct *, const char *);
 static void user_warning(png_struct *, const char *);
 
+/*
+ * Resampling settings per output size band, for each code path.  Online
+ * renders keep Catmull-Rom: the cheaper kernels cost the same per input
+ * sample in oil, so they would only lose sharpness.  Prerendered rungs
+ * use the sharper Lanczos-2 once there are enough pixels for its
+ * ringing to stay invisible.  Tiny online renders skip the sRGB
+ * linearization, the difference does not show at that size.
+ */
+static const struct {
+	uint32_t		 max;
+	struct oil_scale_opts	 opts[2];
+} bands[] = {
+	{ 32, { { OIL_FILTER_CATROM, 1 }, { OIL_FILTER_CATROM, 0 } } },
+	{ UINT32_MAX, { { OIL_FILTER_CATROM, 0 },
+	    { OIL_FILTER_LANCZOS2, 0 } } },
+};
+
 struct pngdata {
 	unsigned char	*data;
 	size_t		 dataz;
 };
 
-size_t pngscale(FILE *input, unsigned char **output, uint32_t width)
+/*
+ * Scaler stage of a pipelined pngscale(), between the decoder thread of
+ * oil_libpng and the encoder on the calling thread.
+ */
+struct pipe_scaler {
+	struct oil_libpng	*ol;
+	struct oil_ring		*ring;
+	uint32_t		 height;
+	int			 rc;
+};
+
+static const struct oil_scale_opts *
+pngscale_opts(uint32_t size, enum pngscale_path path)
 {
-	png_structp rpng, wpng;
-	png_infop rinfo, winfo;
-	png_uint_32 in_width, in_height;
-	png_byte ctype;
-	uint32_t height = width;
-	unsigned char *outbuf;
-	struct oil_libpng ol;
-	struct pngdata pngdata;
+	size_t	 i;
+
+	for (i = 0; bands[i].max < size; i++)
+		continue;
+	return(&bands[i].opts[path]);
+}
+
+/*
+ * Open a libpng reader on input, set up to expand everything to 8-bit
+ * G, GA, RGB or RGBA.
+ */
+static png_structp
+reader_open(FILE *input, png_infop *rinfo)
+{
+	png_structp rpng;
 
-	pngdata.data = NULL;
-	pngdata.dataz = 0;
 	rpng = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
 	    user_error, user_warning);
-	if (NULL == rpng) {
-		*output = NULL;
-		return(0);
-	}
-	rinfo = png_create_info_struct(rpng);
-	if (NULL == rinfo) {
+	if (NULL == rpng)
+		return(NULL);
+	*rinfo = png_create_info_struct(rpng);
+	if (NULL == *rinfo) {
 		png_destroy_read_struct(&rpng, NULL, NULL);
-		*output = NULL;
-		return(0);
+		return(NULL);
 	}
 	png_init_io(rpng, input);
-	png_read_info(rpng, rinfo);
+	png_read_info(rpng, *rinfo);
 
 	png_set_packing(rpng);
 	png_set_strip_16(rpng);
 	png_set_expand(rpng);
 	png_set_interlace_handling(rpng);
-	png_read_update_info(rpng, rinfo);
+	png_read_update_info(rpng, *rinfo);
+	return(rpng);
+}
 
-	in_width = png_get_image_width(rpng, rinfo);
-	in_height = png_get_image_height(rpng, rinfo);
-	oil_fix_ratio(in_width, in_height, &width, &height);
+/*
+ * Decoder on input: libspng if built with it, unless PNGSCALE_DECODER is
+ * set to "libpng" in the environment, and libpng otherwise or for images
+ * libspng is not trusted with.
+ */
+static int
+decoder_open(FILE *input, struct oil_decoder *dec)
+{
+	png_structp rpng;
+	png_infop rinfo;
+	off_t start;
+	const char *name;
 
-	wpng = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
-	    user_error, user_warning);
-	if (NULL == wpng) {
-		png_destroy_read_struct(&rpng, &rinfo, NULL);
-		*output = NULL;
-		return(0);
+	name = getenv("PNGSCALE_DECODER");
+	start = ftello(input);
+	if (-1 != start && (NULL == name || 0 != strcmp(name, "libpng"))) {
+		if (0 == oil_decoder_spng(dec, input))
+			return(0);
+		if (0 != fseeko(input, start, SEEK_SET))
+			return(-1);
 	}
-	winfo = png_create_info_struct(wpng);
-	if (NULL == winfo) {
+	if (NULL == (rpng = reader_open(input, &rinfo)))
+		return(-1);
+	if (0 != oil_decoder_libpng(dec, rpng, rinfo)) {
 		png_destroy_read_struct(&rpng, &rinfo, NULL);
-		png_destroy_write_struct(&wpng, NULL);
-		*output = NULL;
-		return(0);
+		return(-1);
 	}
-	png_set_write_fn(wpng, &pngdata, my_png_writer, my_png_flusher);
-	if (0 != oil_libpng_init(&ol, rpng, rinfo, width, height)) {
+	return(0);
+}
+
+static void
+decoder_close(struct oil_decoder *dec)
+{
+	if (NULL != dec->rpng)
+		png_destroy_read_struct(&dec->rpng, &dec->rinfo, NULL);
+	oil_decoder_free(dec);
+}
+
+/*
+ * Encoder for a width x height image out of rows in colour space cs,
+ * written without the pad of RGBX.  Large images are deflated on up to
+ * threads threads besides the calling one, and no more than one per CPU.
+ */
+static struct pngenc *
+encoder_open(uint32_t width, uint32_t height, enum oil_colorspace cs,
+    int threads)
+{
+	struct pngenc *enc;
+	enum colourtype colour;
+	long cpus;
+
+	switch (cs) {
+	case OIL_CS_G:
+		colour = COLOUR_TYPE_GREYSCALE;
+		break;
+	case OIL_CS_GA:
+		colour = COLOUR_TYPE_GREYSCALE_ALPHA;
+		break;
+	case OIL_CS_RGBA:
+	case OIL_CS_RGBA_NOGAMMA:
+		colour = COLOUR_TYPE_TRUECOLOUR_ALPHA;
+		break;
+	default:
+		colour = COLOUR_TYPE_TRUECOLOUR;
+		break;
+	}
+	enc = pngenc_new(width, height, colour, OIL_CMP(cs));
+	if (NULL == enc) {
 		fprintf(stderr, "Unable to allocate buffers.\n");
-		png_destroy_read_struct(&rpng, &rinfo, NULL);
-		png_destroy_write_struct(&wpng, &winfo);
-		*output = NULL;
-		return(0);
+		return(NULL);
 	}
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 0 && threads > cpus)
+		threads = cpus;
+	pngenc_zpar(enc, PNGSCALE_ZPAR_BLOCK, threads < 1 ? 1 : threads);
+	return(enc);
+}
 
-	ctype = png_get_color_type(rpng, rinfo);
-	png_set_IHDR(wpng, winfo, width, height, 8, ctype, PNG_INTERLACE_NONE,
-		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+/*
+ * Square window of a width x height source for the given gravity.
+ */
+static void
+crop_square(uint32_t width, uint32_t height, enum pngscale_gravity gravity,
+    struct oil_libpng_crop *crop)
+{
+	uint32_t side;
+
+	side = width < height ? width : height;
+	crop->width = crop->height = side;
+	crop->x = (width - side) / 2;
+	crop->y = (height - side) / 2;
+	switch (gravity) {
+	case PNGSCALE_NORTH:
+		crop->y = 0;
+		break;
+	case PNGSCALE_SOUTH:
+		crop->y = height - side;
+		break;
+	case PNGSCALE_WEST:
+		crop->x = 0;
+		break;
+	case PNGSCALE_EAST:
+		crop->x = width - side;
+		break;
+	default:
+		break;
+	}
+}
 
-	png_write_info(wpng, winfo);
+/*
+ * Scale and encode every row.  Returns 0 on success, 1 if the source
+ * is not opaque after all and -1 on error.
+ */
+static int
+encode_rows(struct oil_libpng *ol, struct pngenc *enc, uint32_t width,
+    uint32_t height)
+{
+	unsigned char *outbuf, *outrows[PNGSCALE_BATCH];
+	uint32_t i, n;
+	int rc;
 
-	if (NULL == (outbuf = malloc(width * OIL_CMP(ol.os.cs)))) {
+	outbuf = malloc(PNGSCALE_BATCH * width * OIL_CMP(ol->os.cs));
+	if (NULL == outbuf) {
 		fprintf(stderr, "Unable to allocate buffers.\n");
-		png_destroy_read_struct(&rpng, &rinfo, NULL);
-		png_destroy_write_struct(&wpng, &winfo);
-		*output = NULL;
-		return(0);
+		return(-1);
 	}
-
-	for (uint32_t i = 0; i < height; i++) {
-		oil_libpng_read_scanline(&ol, outbuf);
-		png_write_row(wpng, outbuf);
+	rc = 0;
+	for (i = 0; i < PNGSCALE_BATCH; i++)
+		outrows[i] = outbuf + i * width * OIL_CMP(ol->os.cs);
+	for (i = 0; i < height; i += n) {
+		n = height - i < PNGSCALE_BATCH ? height - i : PNGSCALE_BATCH;
+		if (0 != oil_libpng_read_scanlines(ol, outrows, n)) {
+			rc = 1;
+			break;
+		}
+		if (0 != pngenc_rows(enc, outrows, n)) {
+			rc = -1;
+			break;
+		}
 	}
-        png_write_end(wpng, winfo);
-	png_destroy_write_struct(&wpng, &winfo);
-	png_destroy_read_struct(&rpng, &rinfo, NULL);
 	free(outbuf);
-	oil_libpng_free(&ol);
-	(*output) = pngdata.data;
-	return(pngdata.dataz);
+	return(rc);
+}
+
+static void *
+scaler_main(void *arg)
+{
+	struct pipe_scaler	*ps;
+	unsigned char		**rows;
+	uint32_t		 i, n;
+
+	ps = arg;
+	for (i = 0; i < ps->height; i += n) {
+		n = ps->height - i < PNGSCALE_BATCH ?
+		    ps->height - i : PNGSCALE_BATCH;
+		if (NULL == (rows = oil_ring_produce(ps->ring)))
+			break;
+		if (0 != oil_libpng_read_scanlines(ps->ol, rows, n)) {
+			ps->rc = 1;
+			break;
+		}
+		oil_ring_publish(ps->ring, n);
+	}
+	oil_ring_close(ps->ring);
+	return(NULL);
+}
+
+/*
+ * Same as encode_rows(), with the scaler on a thread of its own feeding
+ * the encoder through a ring of row batches.  Returns -2 if the thread
+ * cannot be started, nothing has been done then.
+ */
+static int
+encode_pipelined(struct oil_libpng *ol, struct pngenc *enc, uint32_t width,
+    uint32_t height)
+{
+	pthread_t		 scaler;
+	unsigned char		**rows;
+	int			 n, rc;
+	struct pipe_scaler	 ps;
+
+	ps.ol = ol;
+	ps.height = height;
+	ps.rc = 0;
+	ps.ring = oil_ring_new(PNGSCALE_PIPE_SLOTS, PNGSCALE_BATCH,
+	    width * OIL_CMP(ol->os.cs), 0);
+	if (NULL == ps.ring)
+		return(-2);
+	if (0 != pthread_create(&scaler, NULL, scaler_main, &ps)) {
+		oil_ring_free(ps.ring);
+		return(-2);
+	}
+	rc = 0;
+	while (NULL != (rows = oil_ring_consume(ps.ring, &n))) {
+		rc = pngenc_rows(enc, rows, n);
+		oil_ring_release(ps.ring);
+		if (0 != rc) {
+			oil_ring_close(ps.ring);
+			break;
+		}
+	}
+	pthread_join(scaler, NULL);
+	oil_ring_free(ps.ring);
+	return(0 != rc ? rc : ps.rc);
 }
 
-static void my_png_writer(png_struct *png, png_byte *data, size_t dataz)
+/*
+ * Scale input into pngdata.  With opaque set, RGBA input is taken as
+ * fully opaque and scaled and written as RGB.  Returns 0 on success, 1
+ * if that assumption turned out wrong and -1 on error.  pngdata is left
+ * empty unless 0 is returned.
+ */
+static int
+pngscale_try(FILE *input, struct pngdata *pngdata, uint32_t width,
+    enum pngscale_path path, int opaque)
 {
-	size_t		 newsize;
-	unsigned char	*tempdata;
-	struct pngdata	*pngdata;
-
-	pngdata = (struct pngdata *)png_get_io_ptr(png);
-	newsize = dataz + pngdata->dataz;
-	tempdata = realloc(pngdata->data, newsize);
-	if (NULL == tempdata) {
+	uint32_t in_width, in_height;
+	uint64_t threads;
+	uint32_t height = width;
+	int pipe, zthreads, rc;
+	struct oil_decoder dec;
+	struct oil_libpng ol;
+	struct pngenc *enc;
+	struct oil_libpng_crop crop, *cropp;
+	const struct oil_scale_opts *opts;
+
+	pngdata->data = NULL;
+	pngdata->dataz = 0;
+	if (0 != decoder_open(input, &dec))
+		return(-1);
+
+	in_width = dec.width;
+	in_height = dec.height;
+	cropp = NULL;
+	if (PNGSCALE_FIT == PNGSCALE_GRAVITY)
+		oil_fix_ratio(in_width, in_height, &width, &height);
+	else if (in_width != in_height) {
+		crop_square(in_width, in_height, PNGSCALE_GRAVITY, &crop);
+		cropp = &crop;
+	}
+
+	opts = pngscale_opts(width > height ? width : height, path);
+	if (0 != oil_libpng_init_decoder(&ol, &dec, cropp, width, height,
+	    opts, opaque)) {
+		fprintf(stderr, "Unable to allocate buffers.\n");
+		decoder_close(&dec);
+		return(-1);
+	}
+
+	/* the decoder and encoder threads come out of the budget */
+	pipe = (uint64_t)in_width * in_height + (uint64_t)width * height >=
+	    PNGSCALE_PIPE_PIXELS;
+	threads = (uint64_t)ol.os.in_width * ol.os.in_height /
+	    PNGSCALE_MT_PIXELS;
+	if (threads > PNGSCALE_MAX_THREADS - (pipe ? 2 : 0))
+		threads = PNGSCALE_MAX_THREADS - (pipe ? 2 : 0);
+	if (threads > 1 && 0 != oil_libpng_set_threads(&ol, threads)) {
+		fprintf(stderr, "Unable to start threads, scaling sequentially.\n");
+		threads = 1;
+	}
+	if (pipe && 0 != oil_libpng_set_pipeline(&ol, PNGSCALE_PIPE_SLOTS)) {
+		fprintf(stderr, "Unable to start threads, decoding inline.\n");
+		pipe = 0;
+	}
+
+	/* and deflating gets what is left of it, the calling thread included */
+	zthreads = PNGSCALE_MAX_THREADS - (pipe ? 2 : 0) -
+	    (threads > 1 ? (int)threads : 1);
+	if (NULL == (enc = encoder_open(width, height, ol.os.cs, zthreads))) {
+		oil_libpng_free(&ol);
+		decoder_close(&dec);
+		return(-1);
+	}
+
+	rc = -2;
+	if (pipe)
+		rc = encode_pipelined(&ol, enc, width, height);
+	if (-2 == rc)
+		rc = encode_rows(&ol, enc, width, height);
+	if (0 == rc && 0 != pngenc_finish(enc, &pngdata->data,
+	    &pngdata->dataz)) {
+		fprintf(stderr, "Unable to encode image.\n");
+		rc = -1;
+	}
+	pngenc_free(enc);
+	oil_libpng_free(&ol);
+	if (0 == rc && dec.error) {
+		fprintf(stderr, "Unable to decode image.\n");
 		free(pngdata->data);
 		pngdata->data = NULL;
 		pngdata->dataz = 0;
-		return;
+		rc = -1;
 	}
-	pngdata->data = tempdata;
-	memcpy(pngdata->data + pngdata->dataz, data, dataz);
-	pngdata->dataz = newsize;
+	decoder_close(&dec);
+	return(rc);
 }
 
-static void my_png_flusher(png_struct *png)
+/*
+ * Most RGBA avatars are exported from editors with alpha 255 everywhere,
+ * so RGBA input is first scaled as RGB.  The first row with some
+ * transparency stops that, and the input is then read again from where
+ * it started.
+ */
+size_t pngscale(FILE *input, unsigned char **output, uint32_t width,
+    enum pngscale_path path)
 {
-	(void)png;
+	off_t start;
+	int rc;
+	struct pngdata pngdata;
+
+	start = ftello(input);
+	rc = pngscale_try(input, &pngdata, width, path, -1 != start);
+	if (1 == rc) {
+		if (0 == fseeko(input, start, SEEK_SET))
+			rc = pngscale_try(input, &pngdata, width, path, 0);
+		else
+			rc = -1;
+	}
+	*output = pngdata.data;
+	return(0 == rc ? pngdata.dataz : 0);
+}
+
+/*
+ * Same as pngscale_try(), for the n outputs of pngscale_multi().
+ */
+static int
+pngscale_multi_try(FILE *input, const uint32_t *sizes, size_t n,
+    unsigned char **outputs, size_t *outputz, enum pngscale_path path,
+    int opaque)
+{
+	unsigned char *row;
+	int *widths, *heights, i, rc;
+	size_t j;
+	struct oil_scale_opts *opts;
+	struct oil_decoder dec;
+	struct oil_libpng_multi olm;
+	struct oil_libpng_crop crop, *cropp;
+	struct pngenc **enc;
+
+	rc = -1;
+	for (j = 0; j < n; j++) {
+		outputs[j] = NULL;
+		outputz[j] = 0;
+	}
+	if (0 != decoder_open(input, &dec))
+		return(-1);
+
+	widths = calloc(n, sizeof(int));
+	heights = calloc(n, sizeof(int));
+	opts = calloc(n, sizeof(struct oil_scale_opts));
+	enc = calloc(n, sizeof(struct pngenc *));
+	if (NULL == widths || NULL == heights || NULL == opts || NULL == enc)
+		goto out;
+
+	cropp = NULL;
+	if (PNGSCALE_FIT != PNGSCALE_GRAVITY && dec.width != dec.height) {
+		crop_square(dec.width, dec.height, PNGSCALE_GRAVITY, &crop);
+		cropp = &crop;
+	}
+	for (j = 0; j < n; j++) {
+		widths[j] = heights[j] = sizes[j];
+		if (NULL == cropp)
+			oil_fix_ratio(dec.width, dec.height, &widths[j],
+			    &heights[j]);
+		opts[j] = *pngscale_opts(widths[j] > heights[j] ?
+		    widths[j] : heights[j], path);
+	}
+
+	if (0 != oil_libpng_multi_init_decoder(&olm, &dec, cropp, n, widths,
+	    heights, opts, opaque)) {
+		fprintf(stderr, "Unable to allocate buffers.\n");
+		goto out;
+	}
+	for (j = 0; j < n; j++) {
+		enc[j] = encoder_open(widths[j], heights[j],
+		    olm.ms.os[j].cs, PNGSCALE_MAX_THREADS - 1);
+		if (NULL == enc[j]) {
+			oil_libpng_multi_free(&olm);
+			goto out;
+		}
+	}
+
+	while ((i = oil_libpng_multi_read_scanline(&olm, &row)) >= 0)
+		if (0 != pngenc_rows(enc[i], &row, 1)) {
+			oil_libpng_multi_free(&olm);
+			goto out;
+		}
+	oil_libpng_multi_free(&olm);
+	if (-2 == i) {
+		rc = 1;
+		goto out;
+	}
+
+	for (j = 0; j < n; j++) {
+		if (0 != pngenc_finish(enc[j], &outputs[j], &outputz[j]))
+			goto out;
+	}
+	if (dec.error) {
+		fprintf(stderr, "Unable to decode image.\n");
+		goto out;
+	}
+	rc = 0;
+out:
+	for (j = 0; NULL != enc && j < n; j++) {
+		pngenc_free(enc[j]);
+		if (0 != rc) {
+			free(outputs[j]);
+			outputs[j] = NULL;
+			outputz[j] = 0;
+		}
+	}
+	decoder_close(&dec);
+	free(widths);
+	free(heights);
+	free(opts);
+	free(enc);
+	return(rc);
+}
+
+/*
+ * RGBA input is first scaled as RGB, as with pngscale().
+ */
+int pngscale_multi(FILE *input, const uint32_t *sizes, size_t n,
+    unsigned char **outputs, size_t *outputz, enum pngscale_path path)
+{
+	off_t start;
+	int rc;
+
+	start = ftello(input);
+	rc = pngscale_multi_try(input, sizes, n, outputs, outputz, path,
+	    -1 != start);
+	if (1 == rc) {
+		if (0 == fseeko(input, start, SEEK_SET))
+			rc = pngscale_multi_try(input, sizes, n, outputs,
+			    outputz, path, 0);
+		else
+			rc = -1;
+	}
+	return(0 == rc ? 0 : -1);
 }
 
 static void user_error(png_struct *png, const char *error)
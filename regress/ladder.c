@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2018 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Build a ladder out of the source image given as first argument into
+ * the file given as second argument.  Check that every size decodes to
+ * a valid size x size PNG carrying the CRC-32 of its ETag, that a few
+ * of them have the pixels of a live pngscale() render, and that the
+ * ladder is not used anymore once the source changes.  Prints what
+ * fails and exits non-zero if anything does.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+#include <zlib.h>
+
+#include "../libravatar.h"
+
+/* sizes also rendered live, around the band edges of pngscale() */
+static const size_t live[] = { 1, 32, 33, 80, 512 };
+
+/*
+ * Decode a PNG from memory to RGBA, independently of pngscale().
+ */
+static unsigned char *
+decode(const unsigned char *data, size_t dataz, png_uint_32 *width,
+    png_uint_32 *height)
+{
+	png_image	 image;
+	unsigned char	*pixels;
+
+	(void)memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	if (0 == png_image_begin_read_from_memory(&image, data, dataz))
+		return(NULL);
+	image.format = PNG_FORMAT_RGBA;
+	if (NULL == (pixels = malloc(PNG_IMAGE_SIZE(image)))) {
+		png_image_free(&image);
+		return(NULL);
+	}
+	if (0 == png_image_finish_read(&image, NULL, pixels, 0, NULL)) {
+		free(pixels);
+		return(NULL);
+	}
+	*width = image.width;
+	*height = image.height;
+	return(pixels);
+}
+
+static int
+check(const struct ladder *l, size_t size)
+{
+	struct embedded	 png;
+	unsigned char	*pixels;
+	png_uint_32	 width, height;
+	char		 etag[64], want[64];
+
+	if (0 != ladder_get(l, size, &png, etag, sizeof(etag)))
+		return(-1);
+	(void)snprintf(want, sizeof(want), "\"default-%zu-%08lx\"", size,
+	    crc32(crc32(0, Z_NULL, 0), png.data, png.dataz));
+	if (0 != strcmp(etag, want))
+		return(-1);
+	if (NULL == (pixels = decode(png.data, png.dataz, &width, &height)))
+		return(-1);
+	free(pixels);
+	return(width == size && height == size ? 0 : -1);
+}
+
+static int
+check_live(const struct ladder *l, FILE *src, size_t size)
+{
+	struct embedded	 png;
+	unsigned char	*data, *pixels, *want;
+	png_uint_32	 width, height;
+	size_t		 dataz;
+	char		 etag[64];
+	int		 rc;
+
+	if (0 != ladder_get(l, size, &png, etag, sizeof(etag)))
+		return(-1);
+	if (0 != fseeko(src, 0, SEEK_SET))
+		return(-1);
+	if (0 == (dataz = pngscale(src, &data, size, PNGSCALE_ONLINE)))
+		return(-1);
+	want = decode(data, dataz, &width, &height);
+	free(data);
+	if (NULL == want)
+		return(-1);
+	if (NULL == (pixels = decode(png.data, png.dataz, &width, &height))) {
+		free(want);
+		return(-1);
+	}
+	rc = 0 == memcmp(pixels, want, (size_t)width * height * 4) ? 0 : -1;
+	free(pixels);
+	free(want);
+	return(rc);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct ladder	 l;
+	struct stat	 st;
+	struct timeval	 tv[2];
+	FILE		*src;
+	size_t		 i;
+	int		 fails;
+
+	if (3 != argc)
+		return(1);
+	if (0 != ladder_build(argv[1], argv[2])) {
+		printf("unable to build %s\n", argv[2]);
+		return(1);
+	}
+	if (0 != ladder_open(&l, argv[1], argv[2])) {
+		printf("unable to open %s\n", argv[2]);
+		return(1);
+	}
+	if (NULL == (src = fopen(argv[1], "r")))
+		return(1);
+	fails = 0;
+	for (i = 1; i <= AVATAR_MAX_SIZE; i++) {
+		if (0 == check(&l, i))
+			continue;
+		printf("size %zu\n", i);
+		fails++;
+	}
+	for (i = 0; i < sizeof(live) / sizeof(live[0]); i++) {
+		if (0 == check_live(&l, src, live[i]))
+			continue;
+		printf("size %zu differs from a live render\n", live[i]);
+		fails++;
+	}
+	fclose(src);
+	ladder_close(&l);
+
+	/* a newer source leaves the ladder aside */
+	if (-1 == stat(argv[1], &st))
+		return(1);
+	tv[0].tv_sec = tv[1].tv_sec = st.st_mtime + 1;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+	if (-1 == utimes(argv[1], tv))
+		return(1);
+	if (0 == ladder_open(&l, argv[1], argv[2])) {
+		printf("stale ladder opened\n");
+		ladder_close(&l);
+		fails++;
+	}
+	return(fails > 0);
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2018 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check the silhouette drawn by mm() against a pixel by pixel rendering
+ * of the same circle and triangle at every size, and the 80 pixels one
+ * against the reference image given as argument.  Prints the sizes that
+ * differ and exits non-zero if there are any.
+ */
+
+#include <arpa/inet.h>
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "../libravatar.h"
+
+/* The silhouette as it was first drawn, one pixel at a time */
+static int
+pixel(size_t width, size_t x, size_t y)
+{
+	int	radius, cx, cy;
+	int	area, p1x, p1y, p2x, p2y;
+	long	fx, fy;
+	int	s, t;
+
+	radius = width / 4;
+	cx = width / 2;
+	cy = width / 3;
+	p1x = width / 5 * 4 - cx;
+	p1y = width - cy;
+	p2x = width / 5 - cx;
+	p2y = width - cy;
+	area = (-p1y * p2x + p1x * p2y) / 2;
+	fx = x - cx;
+	fy = y - cy;
+	if (pow(fx, 2) + pow(fy, 2) - pow(radius, 2) <= 0)
+		return(1);
+	s = p2y * fx + (-p2x) * fy;
+	t = -p1y * fx + (p1x) * fy;
+	return(s > 0 && t > 0 && (s + t) < 2 * area);
+}
+
+static int
+check(size_t width)
+{
+	uint8_t		*buf, *idat, *raw, *p;
+	size_t		 bufz, idatz, scanline, x, y;
+	uLongf		 rawz;
+	uint32_t	 length;
+	int		 rc;
+
+	if (0 != mm(width, &buf, &bufz))
+		return(-1);
+	rc = -1;
+	raw = NULL;
+	idatz = 0;
+	if (NULL == (idat = malloc(bufz)))
+		goto out;
+	for (p = buf + 8; p + 12 <= buf + bufz; p += length + 12) {
+		(void)memcpy(&length, p, sizeof(length));
+		length = ntohl(length);
+		if (0 == memcmp(p + 4, "IDAT", 4)) {
+			(void)memcpy(idat + idatz, p + 8, length);
+			idatz += length;
+		}
+	}
+	scanline = (width + 7) / 8 + 1;
+	rawz = scanline * width;
+	if (NULL == (raw = malloc(rawz)))
+		goto out;
+	if (Z_OK != uncompress(raw, &rawz, idat, idatz) ||
+	    rawz != scanline * width)
+		goto out;
+	for (y = 0; y < width; y++) {
+		if (0 != raw[y * scanline])
+			goto out;
+		for (x = 0; x < width; x++)
+			if (pixel(width, x, y) != ((raw[y * scanline + 1 +
+			    x / 8] >> (7 - x % 8)) & 1))
+				goto out;
+	}
+	rc = 0;
+out:
+	free(buf);
+	free(idat);
+	free(raw);
+	return(rc);
+}
+
+/* Compare with the image the silhouette was taken from */
+static int
+reference(const char *path)
+{
+	FILE		*f;
+	uint8_t		*buf, ref[4096];
+	size_t		 bufz, refz;
+	int		 rc;
+
+	if (NULL == (f = fopen(path, "rb")))
+		return(-1);
+	refz = fread(ref, 1, sizeof(ref), f);
+	fclose(f);
+	if (0 != mm(80, &buf, &bufz))
+		return(-1);
+	rc = bufz == refz && 0 == memcmp(buf, ref, refz) ? 0 : -1;
+	free(buf);
+	return(rc);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t	width;
+	int	fails;
+
+	fails = 0;
+	for (width = 1; width <= 512; width++) {
+		if (0 == check(width))
+			continue;
+		printf("size %zu\n", width);
+		fails++;
+	}
+	if (argc > 1 && 0 != reference(argv[1])) {
+		printf("size 80 differs from %s\n", argv[1]);
+		fails++;
+	}
+	return(fails > 0);
+}
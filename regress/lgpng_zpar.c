@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2018 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check that streams built by zpar inflate back to their input whatever
+ * the block size, thread count and length.  Prints the cases that fail
+ * and exits non-zero if there are any.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "../lgpng.h"
+
+static const size_t lens[] = { 0, 1, 1000, 4096, 4097, 100000, 300000 };
+static const size_t blockszs[] = { 1024, 4096, 65536 };
+static const int threads[] = { 1, 3 };
+
+static int
+check(const uint8_t *data, size_t len, size_t blocksz, int nthreads)
+{
+	struct zpar	*zp;
+	uint8_t		*z, *out;
+	size_t		 zlen, i;
+	uLongf		 outlen;
+	int		 rc;
+
+	rc = -1;
+	out = NULL;
+	z = NULL;
+	if (NULL == (zp = zpar_new(6, Z_FILTERED, blocksz, nthreads)))
+		return(-1);
+	/* odd write sizes, not lined up with blocks */
+	for (i = 0; i < len; i += 777)
+		if (0 != zpar_write(zp, data + i, len - i < 777 ? len - i : 777))
+			goto out;
+	if (0 != zpar_finish(zp, &z, &zlen))
+		goto out;
+	outlen = len + 1;
+	if (NULL == (out = malloc(outlen)))
+		goto out;
+	if (Z_OK != uncompress(out, &outlen, z, zlen) || outlen != len ||
+	    0 != memcmp(out, data, len))
+		goto out;
+	rc = 0;
+out:
+	zpar_free(zp);
+	free(z);
+	free(out);
+	return(rc);
+}
+
+int
+main(void)
+{
+	uint8_t		*data;
+	size_t		 i, l, b, t, max;
+	int		 fails;
+
+	max = lens[sizeof(lens) / sizeof(lens[0]) - 1];
+	if (NULL == (data = malloc(max)))
+		return(1);
+	/* compressible, with matches across block boundaries */
+	srand(1);
+	for (i = 0; i < max; i++)
+		data[i] = i % 5000 < 2500 ? rand() % 16 : data[i % 2500];
+
+	fails = 0;
+	for (l = 0; l < sizeof(lens) / sizeof(lens[0]); l++)
+		for (b = 0; b < sizeof(blockszs) / sizeof(blockszs[0]); b++)
+			for (t = 0; t < sizeof(threads) / sizeof(threads[0]);
+			    t++) {
+				if (0 == check(data, lens[l], blockszs[b],
+				    threads[t]))
+					continue;
+				printf("len %zu block %zu threads %d\n",
+				    lens[l], blockszs[b], threads[t]);
+				fails++;
+			}
+	free(data);
+	return(fails > 0);
+}
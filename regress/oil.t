@@ -0,0 +1,50 @@
+#!/bin/sh
+
+WORKD=$(cd $(dirname $0) && pwd)
+
+test_description="oil resampler accuracy"
+. /usr/local/share/sharness/sharness.sh
+
+# Built by "make regress"
+test -x "$WORKD/oil_reset" && test -x "$WORKD/oil_box" &&
+	test -x "$WORKD/oil_filters" && test -x "$WORKD/oil_nogamma" &&
+	test_set_prereq OIL_REGRESS
+if ! test_have_prereq OIL_REGRESS; then
+	skip_all="skipping all tests as the oil helpers are not built"
+	test_done
+fi
+
+test_expect_success "a reset scaler matches a fresh one" '
+	"$WORKD/oil_reset"
+'
+
+test_expect_success "box pre-reductions stay close to an unreduced scale" '
+	"$WORKD/oil_box"
+'
+
+test_expect_success "every filter stays within 1 of its kernel" '
+	"$WORKD/oil_filters"
+'
+
+test_expect_success "nogamma stays close to linear light on smooth images" '
+	"$WORKD/oil_nogamma"
+'
+
+test_expect_success "parallel deflate streams inflate to their input" '
+	"$WORKD/lgpng_zpar"
+'
+
+test_expect_success "the default ladder holds every size and goes stale" '
+	cp "$WORKD/mm.png" default.png &&
+	"$WORKD/ladder" default.png default.ladder
+'
+
+test_expect_success "libspng decodes to the same rows as libpng" '
+	"$WORKD/oil_decoder"
+'
+
+test_expect_success "the mm silhouette is drawn the same at every size" '
+	"$WORKD/lgpng_mm" "$WORKD/mm.png"
+'
+
+test_done
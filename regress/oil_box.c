@@ -0,0 +1,247 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/**
+ * Compare reductions large enough to be box pre-reduced against a double
+ * precision catmull-rom over the whole, unreduced source. The image is smooth
+ * so that the box only trades away detail the output cannot hold anyway. sRGB
+ * color spaces are filtered in linear light by the reference too. Exits
+ * non-zero when a sample is off by more than MAX_DIFF, or when the samples are
+ * off by more than MAX_MEAN on average.
+ *
+ * Boxes that do not divide the source evenly are a sample wider or narrower
+ * than the others, which moves the pre-reduced samples by up to half a source
+ * sample: 1024 -> 80 is off by up to 6, exact multiples by 1 or 2.
+ */
+
+#include "../oil_resample.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_DIFF 7
+#define MAX_MEAN 2.0
+
+static const enum oil_colorspace spaces[] = {
+	OIL_CS_G, OIL_CS_RGB_NOGAMMA, OIL_CS_CMYK, OIL_CS_RGB,
+};
+
+static const int sizes[][4] = {
+	// in_width, in_height, out_width, out_height
+	{ 1024, 1024, 80, 80 },
+	{ 2000, 100, 50, 5 },
+	{ 640, 480, 64, 48 },
+	{ 1000, 37, 100, 9 },
+	{ 37, 1000, 3, 100 },
+};
+
+static double catrom(double x)
+{
+	if (x < 1) {
+		return (1.5 * x - 2.5) * x * x + 1;
+	}
+	if (x < 2) {
+		return (((5 - x) * x - 8) * x + 4) / 2;
+	}
+	return 0;
+}
+
+static double s2l(double x)
+{
+	x /= 255;
+	return x <= 0.04045 ? x / 12.92 : pow((x + 0.055) / 1.055, 2.4);
+}
+
+static double l2s(double x)
+{
+	x = x <= 0.0031308 ? x * 12.92 : 1.055 * pow(x, 1 / 2.4) - 0.055;
+	return x * 255;
+}
+
+/**
+ * Weights of the input samples lo to hi for output sample pos, with the kernel
+ * trimmed at the edges and normalized.
+ */
+static void weights(int dim_in, int dim_out, int pos, double *w, int *lo,
+	int *hi)
+{
+	int i;
+	double center, scale, sum;
+
+	scale = dim_in > dim_out ? (double)dim_in / dim_out : 1;
+	center = (pos + 0.5) * dim_in / dim_out - 0.5;
+	*lo = floor(center - 2 * scale);
+	*hi = ceil(center + 2 * scale);
+	*lo = *lo < 0 ? 0 : *lo;
+	*hi = *hi > dim_in - 1 ? dim_in - 1 : *hi;
+	sum = 0;
+	for (i=*lo; i<=*hi; i++) {
+		w[i] = catrom(fabs(i - center) / scale);
+		sum += w[i];
+	}
+	for (i=*lo; i<=*hi; i++) {
+		w[i] /= sum;
+	}
+}
+
+static void reference(unsigned char *img, const int *dims,
+	enum oil_colorspace cs, unsigned char *out)
+{
+	int x, y, i, c, cmp, lo, hi;
+	size_t len;
+	double *wx, *wy, *src, *tmp, acc;
+
+	cmp = OIL_CMP(cs);
+	len = (size_t)dims[0] * dims[1] * cmp;
+	wx = malloc(dims[0] * sizeof(double));
+	wy = malloc(dims[1] * sizeof(double));
+	src = malloc(len * sizeof(double));
+	tmp = malloc((size_t)dims[1] * dims[2] * cmp * sizeof(double));
+	if (!wx || !wy || !src || !tmp) {
+		fprintf(stderr, "out of memory\n");
+		exit(2);
+	}
+	for (i=0; i<(int)len; i++) {
+		src[i] = cs == OIL_CS_RGB ? s2l(img[i]) : img[i];
+	}
+	for (x=0; x<dims[2]; x++) {
+		weights(dims[0], dims[2], x, wx, &lo, &hi);
+		for (y=0; y<dims[1]; y++) {
+			for (c=0; c<cmp; c++) {
+				acc = 0;
+				for (i=lo; i<=hi; i++) {
+					acc += wx[i] * src[((size_t)y *
+						dims[0] + i) * cmp + c];
+				}
+				tmp[((size_t)y * dims[2] + x) * cmp + c] = acc;
+			}
+		}
+	}
+	for (y=0; y<dims[3]; y++) {
+		weights(dims[1], dims[3], y, wy, &lo, &hi);
+		for (x=0; x<dims[2] * cmp; x++) {
+			acc = 0;
+			for (i=lo; i<=hi; i++) {
+				acc += wy[i] * tmp[(size_t)i * dims[2] * cmp + x];
+			}
+			if (cs == OIL_CS_RGB) {
+				acc = l2s(acc < 0 ? 0 : acc > 1 ? 1 : acc);
+			}
+			acc = acc < 0 ? 0 : acc > 255 ? 255 : acc;
+			out[(size_t)y * dims[2] * cmp + x] = lround(acc);
+		}
+	}
+	free(wx);
+	free(wy);
+	free(src);
+	free(tmp);
+}
+
+/**
+ * Waves about 10 output samples long, well below what the output can hold.
+ */
+static unsigned char *make_image(const int *dims, int cmp)
+{
+	int x, y, c;
+	double fx, fy;
+	unsigned char *img, *p;
+
+	fx = 2 * M_PI * dims[2] / (10.3 * dims[0]);
+	fy = 2 * M_PI * dims[3] / (9.7 * dims[1]);
+	img = malloc((size_t)dims[0] * dims[1] * cmp);
+	if (!img) {
+		return NULL;
+	}
+	p = img;
+	for (y=0; y<dims[1]; y++) {
+		for (x=0; x<dims[0]; x++) {
+			for (c=0; c<cmp; c++) {
+				*p++ = lround(128 + 100 * sin(x * fx + c) *
+					cos(y * fy - c));
+			}
+		}
+	}
+	return img;
+}
+
+static int scale(unsigned char *img, const int *dims, enum oil_colorspace cs,
+	unsigned char *out)
+{
+	int i, n, in_pos, cmp;
+	struct oil_scale os;
+
+	if (oil_scale_init(&os, dims[1], dims[3], dims[0], dims[2], cs) != 0) {
+		return -1;
+	}
+	cmp = OIL_CMP(cs);
+	in_pos = 0;
+	for (i=0; i<dims[3]; i++) {
+		for (n=oil_scale_slots(&os); n>0; n--) {
+			oil_scale_in(&os, img + (size_t)in_pos++ * dims[0] * cmp);
+		}
+		oil_scale_out(&os, out + (size_t)i * dims[2] * cmp);
+	}
+	oil_scale_free(&os);
+	return 0;
+}
+
+int main(void)
+{
+	int i, j, cmp, diff, max, ret;
+	size_t k, len;
+	double mean;
+	unsigned char *img, *a, *b;
+
+	ret = 0;
+	for (i=0; i<(int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+		for (j=0; j<(int)(sizeof(spaces) / sizeof(spaces[0])); j++) {
+			cmp = OIL_CMP(spaces[j]);
+			len = (size_t)sizes[i][2] * sizes[i][3] * cmp;
+			img = make_image(sizes[i], cmp);
+			a = malloc(len);
+			b = malloc(len);
+			if (!img || !a || !b ||
+				scale(img, sizes[i], spaces[j], a) != 0) {
+				fprintf(stderr, "unable to scale\n");
+				return 2;
+			}
+			reference(img, sizes[i], spaces[j], b);
+			max = 0;
+			mean = 0;
+			for (k=0; k<len; k++) {
+				diff = abs(a[k] - b[k]);
+				max = diff > max ? diff : max;
+				mean += diff;
+			}
+			mean /= len;
+			printf("%dx%d -> %dx%d cs 0x%04x: max diff %d, "
+				"mean %.3f\n", sizes[i][0], sizes[i][1],
+				sizes[i][2], sizes[i][3], spaces[j], max, mean);
+			if (max > MAX_DIFF || mean > MAX_MEAN) {
+				ret = 1;
+			}
+			free(img);
+			free(a);
+			free(b);
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,229 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/**
+ * Check that libspng decodes 8-bit sources of every color type to the same
+ * rows as libpng set up the way pngscale() does it, interlaced or not and with
+ * or without RGB padding. Prints the cases that differ and exits non-zero if
+ * there are any. Passes trivially when built without libspng.
+ */
+
+#include "../config.h"
+#include "../oil_libpng.h"
+#include "../oil_spng.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WIDTH 37
+#define HEIGHT 23
+
+static const struct {
+	int color_type;
+	int trns;
+} cases[] = {
+	{ PNG_COLOR_TYPE_GRAY, 0 },
+	{ PNG_COLOR_TYPE_GA, 0 },
+	{ PNG_COLOR_TYPE_RGB, 0 },
+	{ PNG_COLOR_TYPE_RGB, 1 },
+	{ PNG_COLOR_TYPE_RGBA, 0 },
+	{ PNG_COLOR_TYPE_PALETTE, 0 },
+	{ PNG_COLOR_TYPE_PALETTE, 1 },
+};
+
+/**
+ * Write a noisy WIDTH x HEIGHT source of the given type to a temporary file.
+ */
+static FILE *make_png(int color_type, int trns, int interlace)
+{
+	int i, x, y, channels;
+	FILE *f;
+	png_structp wpng;
+	png_infop winfo;
+	png_color palette[256];
+	png_byte alpha[256];
+	png_color_16 trans;
+	unsigned char row[WIDTH * 4];
+
+	f = tmpfile();
+	wpng = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	winfo = png_create_info_struct(wpng);
+	if (!f || !wpng || !winfo) {
+		exit(1);
+	}
+	png_init_io(wpng, f);
+	png_set_IHDR(wpng, winfo, WIDTH, HEIGHT, 8, color_type,
+		interlace ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	if (color_type == PNG_COLOR_TYPE_PALETTE) {
+		for (i=0; i<256; i++) {
+			palette[i].red = i;
+			palette[i].green = 255 - i;
+			palette[i].blue = i * 7;
+			alpha[i] = i * 3;
+		}
+		png_set_PLTE(wpng, winfo, palette, 256);
+		if (trns) {
+			png_set_tRNS(wpng, winfo, alpha, 100, NULL);
+		}
+	} else if (trns) {
+		memset(&trans, 0, sizeof(trans));
+		trans.red = 10;
+		trans.green = 20;
+		trans.blue = 30;
+		png_set_tRNS(wpng, winfo, NULL, 0, &trans);
+	}
+	png_write_info(wpng, winfo);
+	png_set_interlace_handling(wpng);
+	channels = png_get_channels(wpng, winfo);
+	srand(color_type * 2 + trns);
+	for (i=0; i<(interlace ? 7 : 1); i++) {
+		for (y=0; y<HEIGHT; y++) {
+			for (x=0; x<WIDTH * channels; x++) {
+				row[x] = rand() % 4 == 0 ? 10 * (x % 3 + 1) :
+					rand();
+			}
+			png_write_row(wpng, row);
+		}
+	}
+	png_write_end(wpng, winfo);
+	png_destroy_write_struct(&wpng, &winfo);
+	rewind(f);
+	return f;
+}
+
+/**
+ * Decode every row, in blocks of a few rows unless interlaced.
+ */
+static unsigned char **read_all(struct oil_decoder *dec)
+{
+	int i, n;
+	unsigned char **rows;
+
+	rows = malloc(HEIGHT * sizeof(unsigned char *));
+	if (!rows) {
+		exit(1);
+	}
+	for (i=0; i<HEIGHT; i++) {
+		if (!(rows[i] = malloc(dec->rowbytes))) {
+			exit(1);
+		}
+	}
+	if (dec->interlaced) {
+		dec->read_image(dec, rows);
+		return rows;
+	}
+	for (i=0; i<HEIGHT; i+=n) {
+		n = HEIGHT - i < 5 ? HEIGHT - i : 5;
+		dec->read_rows(dec, rows + i, n);
+	}
+	return rows;
+}
+
+static void free_rows(unsigned char **rows)
+{
+	int i;
+
+	for (i=0; i<HEIGHT; i++) {
+		free(rows[i]);
+	}
+	free(rows);
+}
+
+/**
+ * Decode f through libpng set up the way pngscale() does it.
+ */
+static unsigned char **read_libpng(FILE *f, struct oil_decoder *dec)
+{
+	png_structp rpng;
+	png_infop rinfo;
+	unsigned char **rows;
+
+	rpng = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	rinfo = png_create_info_struct(rpng);
+	png_init_io(rpng, f);
+	png_read_info(rpng, rinfo);
+	png_set_packing(rpng);
+	png_set_strip_16(rpng);
+	png_set_expand(rpng);
+	png_set_interlace_handling(rpng);
+	png_read_update_info(rpng, rinfo);
+	if (oil_decoder_libpng(dec, rpng, rinfo) != 0) {
+		exit(1);
+	}
+	rows = read_all(dec);
+	png_destroy_read_struct(&rpng, &rinfo, NULL);
+	return rows;
+}
+
+static int check(int c, int interlace)
+{
+	int i, ret;
+	FILE *f;
+	struct oil_decoder png_dec, spng_dec;
+	unsigned char **png_rows, **spng_rows;
+
+	f = make_png(cases[c].color_type, cases[c].trns, interlace);
+	png_rows = read_libpng(f, &png_dec);
+	rewind(f);
+	ret = -1;
+	if (oil_decoder_spng(&spng_dec, f) == 0) {
+		if (spng_dec.cs == png_dec.cs &&
+			spng_dec.rowbytes == png_dec.rowbytes &&
+			spng_dec.interlaced == png_dec.interlaced) {
+			spng_rows = read_all(&spng_dec);
+			ret = spng_dec.error ? -1 : 0;
+			for (i=0; i<HEIGHT; i++) {
+				if (memcmp(spng_rows[i], png_rows[i],
+					png_dec.rowbytes)) {
+					ret = -1;
+				}
+			}
+			free_rows(spng_rows);
+		}
+		oil_decoder_free(&spng_dec);
+	}
+	free_rows(png_rows);
+	fclose(f);
+	return ret;
+}
+
+int main(void)
+{
+	int c, interlace, fails;
+
+	if (!HAVE_SPNG) {
+		printf("built without libspng\n");
+		return 0;
+	}
+	fails = 0;
+	for (c=0; c<(int)(sizeof(cases) / sizeof(cases[0])); c++) {
+		for (interlace=0; interlace<2; interlace++) {
+			if (check(c, interlace) == 0) {
+				continue;
+			}
+			printf("color type %d trns %d interlace %d\n",
+				cases[c].color_type, cases[c].trns, interlace);
+			fails++;
+		}
+	}
+	return fails > 0;
+}
@@ -0,0 +1,274 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/**
+ * Compare each filter against the same kernel in double precision, trimmed at
+ * the edges and normalized, on downscales below the box pre-reduction
+ * threshold and on upscales. Like the scaler, the reference stretches a
+ * kernel by its tap count rounded down to an even number rather than by the
+ * exact ratio. Only color spaces without gamma or alpha conversions are used
+ * so that the reference stays simple. Exits non-zero when a sample is off by
+ * more than MAX_DIFF.
+ */
+
+#include "../oil_resample.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_DIFF 1
+
+static const enum oil_colorspace spaces[] = {
+	OIL_CS_G, OIL_CS_RGB_NOGAMMA, OIL_CS_CMYK,
+};
+
+static const int sizes[][4] = {
+	// in_width, in_height, out_width, out_height
+	{ 512, 512, 256, 256 },
+	{ 300, 200, 128, 90 },
+	{ 97, 61, 14, 9 },
+	{ 37, 53, 200, 300 },
+	{ 5, 3, 17, 11 },
+	{ 64, 48, 80, 20 },
+};
+
+static double box(double x)
+{
+	if (x < 0.5) {
+		return 1;
+	}
+	return x == 0.5 ? 0.5 : 0;
+}
+
+static double triangle(double x)
+{
+	return x < 1 ? 1 - x : 0;
+}
+
+static double catrom(double x)
+{
+	if (x < 1) {
+		return (1.5 * x - 2.5) * x * x + 1;
+	}
+	if (x < 2) {
+		return (((5 - x) * x - 8) * x + 4) / 2;
+	}
+	return 0;
+}
+
+static double sinc(double x)
+{
+	return x == 0 ? 1 : sin(x * M_PI) / (x * M_PI);
+}
+
+static double lanczos2(double x)
+{
+	return x < 2 ? sinc(x) * sinc(x / 2) : 0;
+}
+
+static const struct {
+	const char *name;
+	enum oil_filter filter;
+	double (*fn)(double);
+	int taps; // kernel support on both sides.
+} filters[] = {
+	{ "catrom", OIL_FILTER_CATROM, catrom, 4 },
+	{ "box", OIL_FILTER_BOX, box, 2 },
+	{ "triangle", OIL_FILTER_TRIANGLE, triangle, 2 },
+	{ "lanczos2", OIL_FILTER_LANCZOS2, lanczos2, 4 },
+};
+
+/**
+ * Weights of the input samples lo to hi for output sample pos, with the kernel
+ * trimmed at the edges and normalized.
+ */
+static void weights(int dim_in, int dim_out, int pos, int f, double *w,
+	int *lo, int *hi)
+{
+	int i, taps;
+	double center, scale, sum;
+
+	scale = 1;
+	if (dim_in >= dim_out) {
+		taps = filters[f].taps * dim_in / dim_out;
+		scale = (double)(taps - (taps & 1)) / filters[f].taps;
+	}
+	center = (pos + 0.5) * dim_in / dim_out - 0.5;
+	*lo = floor(center - 2 * scale);
+	*hi = ceil(center + 2 * scale);
+	*lo = *lo < 0 ? 0 : *lo;
+	*hi = *hi > dim_in - 1 ? dim_in - 1 : *hi;
+	sum = 0;
+	for (i=*lo; i<=*hi; i++) {
+		w[i] = filters[f].fn(fabs(i - center) / scale);
+		sum += w[i];
+	}
+	for (i=*lo; i<=*hi; i++) {
+		w[i] /= sum;
+	}
+}
+
+static void reference(unsigned char *img, const int *dims, int cmp, int f,
+	unsigned char *out)
+{
+	int x, y, i, c, lo, hi;
+	double *wx, *wy, *tmp, acc;
+
+	wx = malloc(dims[0] * sizeof(double));
+	wy = malloc(dims[1] * sizeof(double));
+	tmp = malloc((size_t)dims[1] * dims[2] * cmp * sizeof(double));
+	if (!wx || !wy || !tmp) {
+		fprintf(stderr, "out of memory\n");
+		exit(2);
+	}
+	for (x=0; x<dims[2]; x++) {
+		weights(dims[0], dims[2], x, f, wx, &lo, &hi);
+		for (y=0; y<dims[1]; y++) {
+			for (c=0; c<cmp; c++) {
+				acc = 0;
+				for (i=lo; i<=hi; i++) {
+					acc += wx[i] * img[((size_t)y *
+						dims[0] + i) * cmp + c];
+				}
+				tmp[((size_t)y * dims[2] + x) * cmp + c] = acc;
+			}
+		}
+	}
+	for (y=0; y<dims[3]; y++) {
+		weights(dims[1], dims[3], y, f, wy, &lo, &hi);
+		for (x=0; x<dims[2] * cmp; x++) {
+			acc = 0;
+			for (i=lo; i<=hi; i++) {
+				acc += wy[i] * tmp[(size_t)i * dims[2] * cmp + x];
+			}
+			acc = acc < 0 ? 0 : acc > 255 ? 255 : acc;
+			out[(size_t)y * dims[2] * cmp + x] = lround(acc);
+		}
+	}
+	free(wx);
+	free(wy);
+	free(tmp);
+}
+
+static unsigned char *make_image(int width, int height, int cmp)
+{
+	int x, y, c;
+	unsigned char *img, *p;
+	unsigned int seed;
+
+	img = malloc((size_t)width * height * cmp);
+	if (!img) {
+		return NULL;
+	}
+	p = img;
+	seed = 1;
+	for (y=0; y<height; y++) {
+		for (x=0; x<width; x++) {
+			for (c=0; c<cmp; c++) {
+				seed = seed * 1103515245 + 12345;
+				// sharp blocks with noise, to provoke overshoot.
+				*p++ = ((x / 7 + y / 5 + c) % 3 ? 230 : 10) +
+					(seed >> 28);
+			}
+		}
+	}
+	return img;
+}
+
+static int scale(unsigned char *img, const int *dims, enum oil_colorspace cs,
+	int f, unsigned char *out)
+{
+	int i, n, in_pos, cmp;
+	struct oil_scale os;
+	struct oil_scale_opts opts = { 0 };
+
+	opts.filter = filters[f].filter;
+	if (oil_scale_init_opts(&os, dims[1], dims[3], dims[0], dims[2], cs,
+		&opts) != 0) {
+		return -1;
+	}
+	cmp = OIL_CMP(cs);
+	in_pos = 0;
+	for (i=0; i<dims[3]; i++) {
+		for (n=oil_scale_slots(&os); n>0; n--) {
+			oil_scale_in(&os, img + (size_t)in_pos++ * dims[0] * cmp);
+		}
+		oil_scale_out(&os, out + (size_t)i * dims[2] * cmp);
+	}
+	oil_scale_free(&os);
+	return 0;
+}
+
+/**
+ * Largest difference between the scaler and the reference, -1 on failure.
+ */
+static int check(int f, const int *dims, enum oil_colorspace cs)
+{
+	int cmp, diff, max;
+	size_t k, len;
+	unsigned char *img, *a, *b;
+
+	cmp = OIL_CMP(cs);
+	len = (size_t)dims[2] * dims[3] * cmp;
+	img = make_image(dims[0], dims[1], cmp);
+	a = malloc(len);
+	b = malloc(len);
+	max = -1;
+	if (img && a && b && scale(img, dims, cs, f, a) == 0) {
+		reference(img, dims, cmp, f, b);
+		max = 0;
+		for (k=0; k<len; k++) {
+			diff = abs(a[k] - b[k]);
+			max = diff > max ? diff : max;
+		}
+	}
+	free(img);
+	free(a);
+	free(b);
+	return max;
+}
+
+int main(void)
+{
+	int f, i, j, max, ret;
+
+	ret = 0;
+	for (f=0; f<(int)(sizeof(filters) / sizeof(filters[0])); f++) {
+		for (i=0; i<(int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+			for (j=0; j<(int)(sizeof(spaces) / sizeof(spaces[0]));
+				j++) {
+				max = check(f, sizes[i], spaces[j]);
+				if (max < 0) {
+					fprintf(stderr, "unable to scale\n");
+					return 2;
+				}
+				printf("%s %dx%d -> %dx%d cs 0x%04x: max diff "
+					"%d\n", filters[f].name, sizes[i][0],
+					sizes[i][1], sizes[i][2], sizes[i][3],
+					spaces[j], max);
+				if (max > MAX_DIFF) {
+					ret = 1;
+				}
+			}
+		}
+	}
+	return ret;
+}
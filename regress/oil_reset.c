@@ -0,0 +1,167 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/**
+ * Check that a scaler reset in the middle of an image scales the next one
+ * exactly like a freshly initialized scaler. Prints the cases that differ and
+ * exits non-zero if there are any.
+ */
+
+#include "../oil_resample.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const enum oil_colorspace spaces[] = {
+	OIL_CS_G, OIL_CS_GA, OIL_CS_RGB, OIL_CS_RGBA, OIL_CS_CMYK,
+};
+
+static const int sizes[][4] = {
+	// in_width, in_height, out_width, out_height
+	{ 512, 512, 80, 80 },
+	{ 300, 200, 100, 100 },
+	{ 640, 480, 160, 120 },
+	{ 80, 80, 512, 512 },
+	{ 37, 53, 200, 300 },
+};
+
+static const struct oil_scale_opts opts[] = {
+	{ .filter = OIL_FILTER_CATROM },
+	{ .filter = OIL_FILTER_LANCZOS2 },
+};
+
+static unsigned char *make_image(int width, int height, int cmp,
+	unsigned int seed)
+{
+	size_t i, len;
+	unsigned char *img;
+
+	len = (size_t)width * height * cmp;
+	img = malloc(len);
+	if (!img) {
+		return NULL;
+	}
+	for (i=0; i<len; i++) {
+		seed = seed * 1103515245 + 12345;
+		img[i] = seed >> 24;
+	}
+	return img;
+}
+
+/**
+ * Scale rows output rows of img with an initialized scaler.
+ */
+static void scale(struct oil_scale *os, unsigned char *img, int rows,
+	unsigned char *out)
+{
+	int i, n, in_pos, cmp;
+
+	cmp = OIL_CMP(os->cs);
+	in_pos = 0;
+	for (i=0; i<rows; i++) {
+		for (n=oil_scale_slots(os); n>0; n--) {
+			oil_scale_in(os, img + (size_t)in_pos++ * os->in_width *
+				cmp);
+		}
+		oil_scale_out(os, out + (size_t)i * os->out_width * cmp);
+	}
+}
+
+static int check(const int *dims, enum oil_colorspace cs,
+	const struct oil_scale_opts *o, int threads)
+{
+	int ret, cmp;
+	size_t len;
+	unsigned char *a, *b, *img1, *img2;
+	struct oil_scale os;
+
+	cmp = OIL_CMP(cs);
+	len = (size_t)dims[2] * dims[3] * cmp;
+	img1 = make_image(dims[0], dims[1], cmp, 1);
+	img2 = make_image(dims[0], dims[1], cmp, 2);
+	a = malloc(len);
+	b = malloc(len);
+	if (!img1 || !img2 || !a || !b) {
+		return -1;
+	}
+
+	if (oil_scale_init_opts(&os, dims[1], dims[3], dims[0], dims[2], cs,
+		o) != 0) {
+		return -1;
+	}
+	oil_scale_set_threads(&os, threads);
+	scale(&os, img2, dims[3], a);
+	oil_scale_free(&os);
+
+	if (oil_scale_init_opts(&os, dims[1], dims[3], dims[0], dims[2], cs,
+		o) != 0) {
+		return -1;
+	}
+	oil_scale_set_threads(&os, threads);
+	scale(&os, img1, dims[3] / 2, b);
+	oil_scale_reset(&os);
+	scale(&os, img2, dims[3], b);
+	ret = memcmp(a, b, len) != 0;
+	oil_scale_reset(&os);
+	scale(&os, img2, dims[3], b);
+	ret |= memcmp(a, b, len) != 0;
+	oil_scale_free(&os);
+
+	free(img1);
+	free(img2);
+	free(a);
+	free(b);
+	return ret;
+}
+
+int main(void)
+{
+	int i, j, k, t, rc, ret;
+
+	ret = 0;
+	for (i=0; i<(int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+		for (j=0; j<(int)(sizeof(spaces) / sizeof(spaces[0])); j++) {
+			for (k=0; k<(int)(sizeof(opts) / sizeof(opts[0])); k++) {
+				for (t=1; t<=3; t+=2) {
+					rc = check(sizes[i], spaces[j],
+						&opts[k], t);
+					if (rc < 0) {
+						fprintf(stderr,
+							"unable to scale\n");
+						return 2;
+					}
+					if (rc) {
+						printf("%dx%d -> %dx%d cs 0x%04x "
+							"opts %d threads %d: "
+							"differs\n",
+							sizes[i][0],
+							sizes[i][1],
+							sizes[i][2],
+							sizes[i][3],
+							spaces[j], k, t);
+						ret = 1;
+					}
+				}
+			}
+		}
+	}
+	return ret;
+}
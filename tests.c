@@ -271,6 +271,19 @@ main(void)
 	return 0;
 }
 #endif /* TEST_SOCK_NONBLOCK */
+#if TEST_SPNG
+#include <spng.h>
+
+int
+main(void)
+{
+	spng_ctx *ctx;
+
+	ctx = spng_ctx_new(0);
+	spng_ctx_free(ctx);
+	return 0;
+}
+#endif /* TEST_SPNG */
 #if TEST_STRLCAT
 #include <string.h>
 